@@ -0,0 +1,186 @@
+/* Copyright (c) 2021 J. von Rotz <jr@vrtz.ch>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include "affinity.h"
+
+#define CPU_ISIN(cs, cpu) ((cs)->bits[(cpu) / 8] & (1 << ((cpu) % 8)))
+
+static void cpu_add(struct CpuSet *cs, int cpu) {
+	if(cpu >= 0 && cpu < AFFINITY_MAXCPUS)
+		cs->bits[cpu / 8] |= 1 << (cpu % 8);
+}
+
+static int node_cpus(int node, struct CpuSet *cs) {
+	char path[128];
+	char list[BUFSIZ];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	if((f = fopen(path, "r")) == NULL)
+		return 1;
+
+	if(fgets(list, sizeof(list), f) == NULL) {
+		fclose(f);
+		return 1;
+	}
+
+	fclose(f);
+	list[strcspn(list, "\n")] = '\0';
+	return affinity_parse(cs, list);
+}
+
+static void format_list(struct CpuSet *cs, int max, char *buf, size_t buflen) {
+	size_t len = 0;
+	int first, last;
+	int i;
+
+	buf[0] = '\0';
+	for(i=0; i<max; i++) {
+		if(!CPU_ISIN(cs, i))
+			continue;
+
+		if(len >= buflen)
+			break;
+
+		first = last = i;
+		while(last + 1 < max && CPU_ISIN(cs, last + 1))
+			last++;
+
+		if(first == last)
+			len += snprintf(buf + len, buflen - len, "%s%d", len > 0 ? "," : "", first);
+		else
+			len += snprintf(buf + len, buflen - len, "%s%d-%d", len > 0 ? "," : "", first, last);
+
+		i = last;
+	}
+}
+
+int affinity_parse(struct CpuSet *cs, const char *list) {
+	const char *p = list;
+	char *end;
+	long first, last;
+
+	/* Same format as the kernel uses for cpulist, e.g. 0-7,16-23 */
+	memset(cs, 0, sizeof(struct CpuSet));
+	while(*p != '\0') {
+		first = strtol(p, &end, 10);
+		if(end == p || first < 0 || first >= AFFINITY_MAXCPUS)
+			return 1;
+
+		last = first;
+		if(*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if(end == p || last < first || last >= AFFINITY_MAXCPUS)
+				return 1;
+		}
+
+		for(; first <= last; first++)
+			cpu_add(cs, first);
+
+		if(*end == ',')
+			end++;
+		else if(*end != '\0')
+			return 1;
+
+		p = end;
+	}
+
+	return affinity_empty(cs);
+}
+
+int affinity_apply(struct CpuSet *cs) {
+	cpu_set_t set;
+	int ret;
+	int i;
+
+	CPU_ZERO(&set);
+	for(i=0; i<AFFINITY_MAXCPUS && i<CPU_SETSIZE; i++) {
+		if(CPU_ISIN(cs, i))
+			CPU_SET(i, &set);
+	}
+
+	if((ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set)) != 0) {
+		fprintf(stderr, "Cannot set CPU affinity: %s\n", strerror(ret));
+		return 1;
+	}
+
+	return 0;
+}
+
+void affinity_note(struct CpuSet *cs) {
+	cpu_add(cs, sched_getcpu());
+}
+
+int affinity_empty(struct CpuSet *cs) {
+	size_t i;
+
+	for(i=0; i<sizeof(cs->bits); i++) {
+		if(cs->bits[i] != 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+void affinity_format(struct CpuSet *cs, char *buf, size_t buflen) {
+	struct CpuSet nodes;
+	struct CpuSet ncs;
+	char cpus[BUFSIZ];
+	char nodelist[BUFSIZ];
+	int node;
+	size_t i;
+
+	/* Nodes whose CPUs overlap the set, as far as sysfs tells */
+	memset(&nodes, 0, sizeof(struct CpuSet));
+	for(node=0; node<AFFINITY_MAXNODES; node++) {
+		if(node_cpus(node, &ncs) != 0)
+			continue;
+
+		for(i=0; i<sizeof(ncs.bits); i++) {
+			if(ncs.bits[i] & cs->bits[i]) {
+				cpu_add(&nodes, node);
+				break;
+			}
+		}
+	}
+
+	format_list(cs, AFFINITY_MAXCPUS, cpus, sizeof(cpus));
+	format_list(&nodes, AFFINITY_MAXNODES, nodelist, sizeof(nodelist));
+	if(nodelist[0] != '\0')
+		snprintf(buf, buflen, "CPU %s (node %s)", cpus, nodelist);
+	else
+		snprintf(buf, buflen, "CPU %s", cpus);
+}
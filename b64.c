@@ -41,38 +41,60 @@ char base46_map[] = {'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I', 'J', 'K', 'L',
                      'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n', 'o', 'p', 'q', 'r', 's', 't', 'u', 'v',
                      'w', 'x', 'y', 'z', '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', '+', '/'};
 
+/* Reverse of base46_map, 64 for anything that is not a base64 digit (including '=') */
+static const unsigned char base64_rev[256] = {64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+                                              64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+                                              64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 62, 64, 64, 64, 63,
+                                              52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 64, 64, 64, 64, 64, 64,
+                                              64,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+                                              15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 64, 64, 64, 64, 64,
+                                              64, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+                                              41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, 64, 64, 64, 64, 64,
+                                              64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+                                              64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+                                              64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+                                              64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+                                              64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+                                              64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+                                              64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+                                              64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64};
 
-char* base64_encode(char* plain, size_t plainsiz) {
 
-    char counts = 0;
-    unsigned char buffer[3];
-    char* cipher = malloc(plainsiz * 4 / 3 + 4 + 1);
-    int i = 0, c = 0;
-
-    for(i = 0; i < plainsiz; i++) {
-        buffer[counts++] = plain[i];
-        if(counts == 3) {
-            cipher[c++] = base46_map[buffer[0] >> 2];
-            cipher[c++] = base46_map[((buffer[0] & 0x03) << 4) + (buffer[1] >> 4)];
-            cipher[c++] = base46_map[((buffer[1] & 0x0f) << 2) + (buffer[2] >> 6)];
-            cipher[c++] = base46_map[buffer[2] & 0x3f];
-            counts = 0;
-        }
+size_t base64_encode_into(const unsigned char* plain, size_t plainsiz, char* cipher) {
+
+    size_t i = 0, c = 0;
+
+    for(i = 0; i + 2 < plainsiz; i += 3) {
+        cipher[c++] = base46_map[plain[i] >> 2];
+        cipher[c++] = base46_map[((plain[i] & 0x03) << 4) + (plain[i+1] >> 4)];
+        cipher[c++] = base46_map[((plain[i+1] & 0x0f) << 2) + (plain[i+2] >> 6)];
+        cipher[c++] = base46_map[plain[i+2] & 0x3f];
     }
 
-    if(counts > 0) {
-        cipher[c++] = base46_map[buffer[0] >> 2];
-        if(counts == 1) {
-            cipher[c++] = base46_map[(buffer[0] & 0x03) << 4];
+    if(i < plainsiz) {
+        cipher[c++] = base46_map[plain[i] >> 2];
+        if(i + 1 == plainsiz) {
+            cipher[c++] = base46_map[(plain[i] & 0x03) << 4];
             cipher[c++] = '=';
-        } else {                      // if counts == 2
-            cipher[c++] = base46_map[((buffer[0] & 0x03) << 4) + (buffer[1] >> 4)];
-            cipher[c++] = base46_map[(buffer[1] & 0x0f) << 2];
+        } else {
+            cipher[c++] = base46_map[((plain[i] & 0x03) << 4) + (plain[i+1] >> 4)];
+            cipher[c++] = base46_map[(plain[i+1] & 0x0f) << 2];
         }
         cipher[c++] = '=';
     }
 
     cipher[c] = '\0';
+    return c;
+}
+
+
+char* base64_encode(char* plain, size_t plainsiz) {
+
+    char* cipher = malloc(BASE64_ENCODED_SIZE(plainsiz));
+
+    if(cipher != NULL)
+        base64_encode_into((unsigned char*)plain, plainsiz, cipher);
+
     return cipher;
 }
 
@@ -85,9 +107,7 @@ char* base64_decode(char* cipher, size_t ciphersiz) {
     int i = 0, p = 0;
 
     for(i = 0; i < ciphersiz; i++) {
-        char k;
-        for(k = 0 ; k < 64 && base46_map[k] != cipher[i]; k++);
-        buffer[counts++] = k;
+        buffer[counts++] = base64_rev[(unsigned char)cipher[i]];
         if(counts == 4) {
             plain[p++] = (buffer[0] << 2) + (buffer[1] >> 4);
             if(buffer[2] != 64)
@@ -1,2 +1,5 @@
+#define BASE64_ENCODED_SIZE(n) (((n) + 2) / 3 * 4 + 1)
+
+size_t base64_encode_into(const unsigned char* plain, size_t plainsiz, char* cipher);
 char* base64_encode(char* plain, size_t plainsiz);
 char* base64_decode(char* cipher, size_t ciphersiz);
@@ -0,0 +1,439 @@
+/* Copyright (c) 2021 J. von Rotz <jr@vrtz.ch>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Micro-benchmarks for the per-request CPU path, in the spirit of Google
+ * Benchmark: every case runs with a growing iteration count until it has
+ * taken at least BENCH_MIN_TIME, then reports wall and CPU time per
+ * iteration plus throughput where that makes sense. CPU time is that of
+ * the benchmarking thread, so the stub server's threads do not count.
+ * Input data is set up once per case, outside the timed rounds. An optional
+ * argument only runs cases whose name contains it, e.g. ./bench base64
+ *
+ * s3.c is built with the flags of libs3ar.a plus S3_SCHEME "http" for this,
+ * so the end-to-end case can talk to a stub server on the loopback interface.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <openssl/hmac.h>
+#include "s3.h"
+#include "b64.h"
+
+#define BENCH_MIN_TIME 0.5
+#define BENCH_MAX_ITERATIONS 1000000000ULL
+#define STUB_ETAG "\"5d852e7700e2e97acd69256f5569f6e9\""
+
+struct BenchState {
+	unsigned long long iterations;
+	unsigned long long bytes;   /* Bytes processed per iteration, for bytes_per_second */
+	short items;                /* Report iterations as items_per_second */
+	const char *error;
+};
+
+struct Bench {
+	const char *name;
+	void (*fn)(struct BenchState *st);
+	size_t arg;
+	void (*setup)(struct BenchState *st); /* Runs once before the timed rounds, may be NULL */
+};
+
+static size_t bench_arg;
+static char bench_endpoint[64];
+
+/* Fixture shared by all rounds of a case, set up by its setup function and freed by run() */
+static char *bench_plain;
+static char *bench_cipher;
+static size_t bench_cipherlen;
+
+static const char date[] = "Mon, 19 Oct 2026 10:00:00 +0000";
+static const char getparms[] = "partNumber=42&uploadId=b12203c71a2f408aaf4a90e0866ad5d7";
+static const char etagline[] = "ETag: " STUB_ETAG "\r\n";
+static const char initresponse[] = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<InitiateMultipartUploadResult xmlns=\"http://s3.amazonaws.com/doc/2006-03-01/\"><Bucket>backup</Bucket><Key>importantstuff_backup_20210505.tar</Key><UploadId>2~b12203c71a2f408aaf4a90e0866ad5d7</UploadId></InitiateMultipartUploadResult>";
+
+/* Keep the compiler from optimizing away results nobody looks at */
+static void sink(const void *p) {
+	__asm__ __volatile__("" : : "g"(p) : "memory");
+}
+
+static double now(clockid_t clock) {
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *random_bytes(size_t len) {
+	char *buf = malloc(len);
+	size_t i;
+
+	for(i=0; i<len && buf != NULL; i++)
+		buf[i] = rand();
+
+	return buf;
+}
+
+static void setup_plain(struct BenchState *st) {
+	if((bench_plain = random_bytes(bench_arg)) == NULL)
+		st->error = "cannot allocate input";
+}
+
+static void setup_cipher(struct BenchState *st) {
+	setup_plain(st);
+	if(st->error == NULL && (bench_cipher = base64_encode(bench_plain, bench_arg)) == NULL)
+		st->error = "cannot encode input";
+	else if(st->error == NULL)
+		bench_cipherlen = strlen(bench_cipher);
+}
+
+static void setup_encode_into(struct BenchState *st) {
+	setup_plain(st);
+	if(st->error == NULL && (bench_cipher = malloc(BASE64_ENCODED_SIZE(bench_arg))) == NULL)
+		st->error = "cannot allocate output";
+}
+
+static void BM_string_to_sign(struct BenchState *st) {
+	char m[BUFSIZ];
+	unsigned long long i;
+
+	for(i=0; i<st->iterations; i++) {
+		s3_string_to_sign(m, sizeof(m), "PUT", "application/octet-stream", date, "backup", "/importantstuff_backup_20210505.tar", getparms);
+		sink(m);
+	}
+}
+
+static void BM_hmac_sha1(struct BenchState *st) {
+	char m[BUFSIZ];
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int md_len;
+	int mlen = s3_string_to_sign(m, sizeof(m), "PUT", "application/octet-stream", date, "backup", "/importantstuff_backup_20210505.tar", getparms);
+	unsigned long long i;
+
+	for(i=0; i<st->iterations; i++) {
+		HMAC(EVP_sha1(), "secret", 6, (unsigned char *)m, mlen, md, &md_len);
+		sink(md);
+	}
+}
+
+static void BM_sign(struct BenchState *st) {
+	char m[BUFSIZ];
+	char sig[S3_SIGNATURE_SIZE];
+	int mlen;
+	unsigned long long i;
+
+	/* Everything s3_talk() does to get from a request to its Authorization header */
+	for(i=0; i<st->iterations; i++) {
+		mlen = s3_string_to_sign(m, sizeof(m), "PUT", "application/octet-stream", date, "backup", "/importantstuff_backup_20210505.tar", getparms);
+		s3_sign(sig, "secret", m, mlen);
+		sink(sig);
+	}
+}
+
+static void BM_base64_encode(struct BenchState *st) {
+	char *cipher;
+	unsigned long long i;
+
+	for(i=0; i<st->iterations; i++) {
+		cipher = base64_encode(bench_plain, bench_arg);
+		sink(cipher);
+		free(cipher);
+	}
+
+	st->bytes = bench_arg;
+}
+
+static void BM_base64_encode_into(struct BenchState *st) {
+	unsigned long long i;
+
+	for(i=0; i<st->iterations; i++) {
+		base64_encode_into((unsigned char *)bench_plain, bench_arg, bench_cipher);
+		sink(bench_cipher);
+	}
+
+	st->bytes = bench_arg;
+}
+
+static void BM_base64_decode(struct BenchState *st) {
+	char *decoded;
+	unsigned long long i;
+
+	for(i=0; i<st->iterations; i++) {
+		decoded = base64_decode(bench_cipher, bench_cipherlen);
+		sink(decoded);
+		free(decoded);
+	}
+
+	st->bytes = bench_cipherlen;
+}
+
+static void BM_strip_etag(struct BenchState *st) {
+	char *etag;
+	unsigned long long i;
+
+	for(i=0; i<st->iterations; i++) {
+		etag = strip_etag(etagline, sizeof(etagline) - 1);
+		sink(etag);
+		free(etag);
+	}
+}
+
+static void BM_uploadid_parse(struct BenchState *st) {
+	const char *value;
+	size_t len;
+	unsigned long long i;
+
+	for(i=0; i<st->iterations; i++) {
+		value = s3_xml_value(initresponse, "UploadId", &len);
+		sink(value);
+	}
+}
+
+static void *stub_conn(void *arg) {
+	int fd = (int)(long)arg;
+	char buf[65536];
+	char *hdrend;
+	char *line;
+	size_t len = 0;
+	size_t body;
+	size_t have;
+	ssize_t n;
+	short expect;
+	static const char reply[] = "HTTP/1.1 200 OK\r\nETag: " STUB_ETAG "\r\nContent-Length: 0\r\n\r\n";
+	static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+	/* Just enough HTTP/1.1 to answer keep-alive PUTs with an ETag */
+	for(;;) {
+		buf[len] = '\0';
+		while((hdrend = strstr(buf, "\r\n\r\n")) == NULL) {
+			if(len == sizeof(buf) - 1 || (n = read(fd, buf + len, sizeof(buf) - 1 - len)) <= 0)
+				goto out;
+			len += n;
+			buf[len] = '\0';
+		}
+
+		body = 0;
+		expect = 0;
+		for(line = strstr(buf, "\r\n"); line != NULL && line < hdrend; line = strstr(line + 2, "\r\n")) {
+			if(strncasecmp(line + 2, "Content-Length:", 15) == 0)
+				body = strtoull(line + 17, NULL, 10);
+			else if(strncasecmp(line + 2, "Expect: 100-continue", 20) == 0)
+				expect = 1;
+		}
+
+		if(expect && write(fd, cont, sizeof(cont) - 1) < 0)
+			goto out;
+
+		have = len - (hdrend + 4 - buf);
+		while(have < body) {
+			if((n = read(fd, buf, sizeof(buf) - 1)) <= 0)
+				goto out;
+			have += n;
+		}
+
+		if(write(fd, reply, sizeof(reply) - 1) < 0)
+			goto out;
+		len = 0;
+	}
+
+out:
+	close(fd);
+	return NULL;
+}
+
+static void *stub_server(void *arg) {
+	int sock = (int)(long)arg;
+	pthread_t thread;
+	int fd;
+
+	while((fd = accept(sock, NULL, NULL)) >= 0) {
+		if(pthread_create(&thread, NULL, stub_conn, (void *)(long)fd) != 0)
+			close(fd);
+		else
+			pthread_detach(thread);
+	}
+
+	return NULL;
+}
+
+static int stub_start(void) {
+	struct sockaddr_in sin;
+	socklen_t sinlen = sizeof(sin);
+	pthread_t thread;
+	int sock;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0 || bind(sock, (struct sockaddr *)&sin, sizeof(sin)) != 0 || listen(sock, 16) != 0 || getsockname(sock, (struct sockaddr *)&sin, &sinlen) != 0)
+		return 1;
+
+	/* The bucket goes in front, and curl resolves *.localhost to the loopback interface */
+	snprintf(bench_endpoint, sizeof(bench_endpoint), "localhost:%d", ntohs(sin.sin_port));
+	return pthread_create(&thread, NULL, stub_server, (void *)(long)sock) != 0;
+}
+
+static void setup_stub(struct BenchState *st) {
+	/* The stub keeps running for later cases */
+	if(bench_endpoint[0] == '\0' && stub_start() != 0) {
+		st->error = "cannot start stub server";
+		return;
+	}
+
+	setup_plain(st);
+}
+
+static void BM_putpart_loopback(struct BenchState *st) {
+	char *etag;
+	size_t etaglen;
+	unsigned long long i;
+
+	for(i=0; i<st->iterations; i++) {
+		etag = NULL;
+		if(s3_putpart(bench_endpoint, "bench", "/bench.bin", "key", "secret", "b12203c71a2f408aaf4a90e0866ad5d7", i % S3_MAX_PART + 1, bench_plain, bench_arg, &etag, &etaglen) != 0) {
+			st->error = "s3_putpart() failed";
+			break;
+		}
+		free(etag);
+	}
+
+	st->bytes = bench_arg;
+	st->items = 1;
+}
+
+static const struct Bench benches[] = {
+	{ "BM_string_to_sign", BM_string_to_sign, 0, NULL },
+	{ "BM_hmac_sha1", BM_hmac_sha1, 0, NULL },
+	{ "BM_sign", BM_sign, 0, NULL },
+	{ "BM_base64_encode", BM_base64_encode, 20, setup_plain },
+	{ "BM_base64_encode_into", BM_base64_encode_into, 20, setup_encode_into },
+	{ "BM_base64_encode_into", BM_base64_encode_into, 65536, setup_encode_into },
+	{ "BM_base64_decode", BM_base64_decode, 20, setup_cipher },
+	{ "BM_base64_decode", BM_base64_decode, 65536, setup_cipher },
+	{ "BM_strip_etag", BM_strip_etag, 0, NULL },
+	{ "BM_uploadid_parse", BM_uploadid_parse, 0, NULL },
+	{ "BM_putpart_loopback", BM_putpart_loopback, 4096, setup_stub },
+	{ "BM_putpart_loopback", BM_putpart_loopback, 1048576, setup_stub },
+};
+
+static void human(double value, double base, char *buf, size_t buflen) {
+	const char *units[] = { "", "k", "M", "G", "T" };
+	int u = 0;
+
+	while(value >= base && u < 4) {
+		value /= base;
+		u++;
+	}
+
+	snprintf(buf, buflen, "%.4g%s", value, units[u]);
+}
+
+static void run(const struct Bench *b) {
+	struct BenchState st;
+	char name[128];
+	char rate[32];
+	double wall, cpu;
+	double w0, c0;
+	unsigned long long next;
+
+	if(b->arg > 0)
+		snprintf(name, sizeof(name), "%s/%zu", b->name, b->arg);
+	else
+		snprintf(name, sizeof(name), "%s", b->name);
+
+	bench_arg = b->arg;
+	memset(&st, 0, sizeof(st));
+	st.iterations = 1;
+
+	if(b->setup != NULL)
+		b->setup(&st);
+
+	while(st.error == NULL) {
+		w0 = now(CLOCK_MONOTONIC);
+		c0 = now(CLOCK_THREAD_CPUTIME_ID);
+		b->fn(&st);
+		wall = now(CLOCK_MONOTONIC) - w0;
+		cpu = now(CLOCK_THREAD_CPUTIME_ID) - c0;
+
+		if(st.error != NULL || wall >= BENCH_MIN_TIME || st.iterations >= BENCH_MAX_ITERATIONS)
+			break;
+
+		/* Aim a bit past the minimum time, but grow by at most 10x per round */
+		next = wall > 0 ? st.iterations * (BENCH_MIN_TIME * 1.4 / wall) : st.iterations * 10;
+		if(next > st.iterations * 10)
+			next = st.iterations * 10;
+		if(next <= st.iterations)
+			next = st.iterations + 1;
+		st.iterations = next;
+	}
+
+	free(bench_plain);
+	free(bench_cipher);
+	bench_plain = bench_cipher = NULL;
+
+	if(st.error != NULL) {
+		printf("%-36s ERROR: %s\n", name, st.error);
+		return;
+	}
+
+	printf("%-36s %10.1f ns %12.1f ns %12llu", name, wall * 1e9 / st.iterations, cpu * 1e9 / st.iterations, st.iterations);
+	if(st.bytes > 0) {
+		human(st.bytes * st.iterations / wall, 1024, rate, sizeof(rate));
+		printf(" bytes_per_second=%s/s", rate);
+	}
+	if(st.items) {
+		human(st.iterations / wall, 1000, rate, sizeof(rate));
+		printf(" items_per_second=%s/s", rate);
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+	size_t i;
+
+	printf("%-36s %13s %15s %12s\n", "Benchmark", "Time", "CPU", "Iterations");
+	printf("--------------------------------------------------------------------------------\n");
+
+	for(i=0; i<sizeof(benches)/sizeof(benches[0]); i++) {
+		if(argc > 1 && strstr(benches[i].name, argv[1]) == NULL)
+			continue;
+
+		run(benches + i);
+	}
+
+	return 0;
+}
@@ -0,0 +1,545 @@
+/* Copyright (c) 2021 J. von Rotz <jr@vrtz.ch>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "s3.h"
+#include "tar.h"
+#include "spool.h"
+#include "upload.h"
+#include "libs3ar.h"
+
+struct S3arPool {
+	struct Pool pool;
+};
+
+struct S3ar {
+	struct Upload up;
+	struct Target *targets;
+	struct S3arTarget *s3artargets;
+	int ntargets;
+	char *aws_path;
+	short spooling;
+	struct Spool spool;
+	pthread_t loader;
+	char *buffer;           /* Part buffer being filled, or the spool chunk */
+	size_t buflen;
+	size_t bufsiz;
+	short do_index;
+	struct TarIndex ti;
+	short failed;           /* Writing failed, the upload will be aborted */
+	struct CpuSet readcpus;
+	struct CpuSet uploadcpus;
+	short pinread;
+	short pinned;           /* The writing thread has been pinned */
+};
+
+static int consume(struct S3ar *h, char *buffer, size_t buflen) {
+	if(h->do_index && tar_index_update(&h->ti, buffer, buflen) != 0) {
+		fprintf(stderr, "Failed to update tar index, continuing without.\n");
+		tar_index_free(&h->ti);
+		h->do_index = 0;
+	}
+
+	return upload_consume(&h->up, buffer, buflen);
+}
+
+static void *spool_loader(void *arg) {
+	struct S3ar *h = (struct S3ar *)arg;
+	struct Upload *up = &h->up;
+	unsigned int partnum;
+	size_t buflen;
+	char *buffer;
+	int ret;
+
+	/* The loader fills the part buffers, so it belongs with the reader */
+	if(h->pinread)
+		affinity_apply(&h->readcpus);
+
+	/* Move spooled parts into the shared part buffers, targets release them from the spool */
+	for(;;) {
+		if((buffer = upload_buffer(up)) == NULL) {
+			spool_abort(up->spool);
+			break;
+		}
+
+		if((ret = spool_next(up->spool, buffer, &buflen, &partnum)) != 0) {
+			if(ret < 0)
+				spool_abort(up->spool);
+			break;
+		}
+
+		upload_publish(up, buflen);
+	}
+
+	return NULL;
+}
+
+static int flush(struct S3ar *h) {
+	if(h->buflen == 0)
+		return 0;
+
+	if(h->spooling) {
+		if(spool_write(&h->spool, h->buffer, h->buflen) != 0)
+			return 1;
+	} else {
+		upload_publish(&h->up, h->buflen);
+		h->buffer = NULL;
+	}
+
+	h->buflen = 0;
+	return 0;
+}
+
+static int rollover(struct S3ar *h, size_t len) {
+	size_t off = h->buflen;
+	char *copy = NULL;
+
+	/* Called with every write, a time based rollover ends the current part and object early and the len bytes just read start the next one */
+	if(!upload_rollover_due(&h->up))
+		return 0;
+
+	if(off > 0 && len > 0 && !h->spooling) {
+		/* Once published, the buffer belongs to the targets and may go back to the pool */
+		if((copy = malloc(len)) == NULL) {
+			fprintf(stderr, "malloc() for rollover failed.\n");
+			return 1;
+		}
+
+		memcpy(copy, h->buffer + off, len);
+	}
+
+	if(flush(h) != 0) {
+		free(copy);
+		return 1;
+	}
+
+	upload_cut(&h->up);
+	if(h->spooling)
+		spool_cut(&h->spool);
+
+	if(off > 0 && len > 0) {
+		if(h->spooling) {
+			memmove(h->buffer, h->buffer + off, len);
+		} else {
+			h->buffer = upload_buffer(&h->up);
+			if(h->buffer != NULL)
+				memcpy(h->buffer, copy, len);
+			free(copy);
+			if(h->buffer == NULL)
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int upload_index(struct S3ar *h) {
+	char *idxpath;
+	char *idxbuf = NULL;
+	size_t idxlen = 0;
+	size_t pathlen;
+	int failed = 0;
+	int n;
+
+	pathlen = strlen(h->aws_path) + strlen(TAR_INDEX_SUFFIX) + 1;
+	idxpath = malloc(pathlen);
+	h->ti.segmented = h->up.rollover;
+	if(idxpath == NULL || tar_index_serialize(&h->ti, &idxbuf, &idxlen) != 0) {
+		fprintf(stderr, "Cannot build tar index.\n");
+		free(idxpath);
+		return -1;
+	}
+
+	snprintf(idxpath, pathlen, "%s%s", h->aws_path, TAR_INDEX_SUFFIX);
+	for(n=0; n<h->ntargets; n++) {
+		if(h->targets[n].failed)
+			continue;
+
+		if(s3_putobject(h->targets[n].endpoint, h->targets[n].bucket, idxpath, h->targets[n].aws_key, h->targets[n].aws_secret, "text/plain", idxbuf, idxlen) != 0) {
+			fprintf(stderr, "Failed to upload tar index %s.\n", idxpath);
+			h->targets[n].failed = 1;
+			failed++;
+		}
+	}
+
+	fprintf(stderr, "Indexed %zu tar members in %s\n", h->ti.nmembers, idxpath);
+	free(idxpath);
+	free(idxbuf);
+	return failed;
+}
+
+static void placement(struct S3ar *h, char *buf, size_t buflen) {
+	char read[128];
+	char upload[128];
+
+	if(affinity_empty(&h->up.readran)) {
+		buf[0] = '\0';
+		return;
+	}
+
+	affinity_format(&h->up.readran, read, sizeof(read));
+	if(affinity_empty(&h->up.uploadran)) {
+		snprintf(buf, buflen, "read on %s", read);
+		return;
+	}
+
+	affinity_format(&h->up.uploadran, upload, sizeof(upload));
+	snprintf(buf, buflen, "read on %s, upload on %s", read, upload);
+}
+
+static void s3ar_free(struct S3ar *h) {
+	if(h->do_index)
+		tar_index_free(&h->ti);
+	if(h->spooling)
+		free(h->buffer);
+	free(h->targets);
+	free(h);
+}
+
+struct S3arPool *s3ar_pool_create(unsigned int buffers, unsigned int transfers) {
+	struct S3arPool *pool = malloc(sizeof(struct S3arPool));
+
+	if(pool == NULL) {
+		fprintf(stderr, "malloc() for pool failed.\n");
+		return NULL;
+	}
+
+	if(pool_init(&pool->pool, buffers, transfers, S3_PUT_BUFSIZ) != 0) {
+		pool_destroy(&pool->pool);
+		free(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+void s3ar_pool_destroy(struct S3arPool *pool) {
+	pool_destroy(&pool->pool);
+	free(pool);
+}
+
+void s3ar_options_init(struct S3arOptions *opts) {
+	memset(opts, 0, sizeof(struct S3arOptions));
+	opts->slack = UPLOAD_DEFAULT_SLACK;
+	opts->spoolmax = SPOOL_DEFAULT_MAX;
+}
+
+struct S3ar *s3ar_open(struct S3arOptions *opts) {
+	struct S3ar *h;
+	struct Target *t;
+	int n;
+
+	if(opts->aws_path == NULL || opts->targets == NULL || opts->ntargets < 1) {
+		fprintf(stderr, "Missing aws_path or targets.\n");
+		return NULL;
+	}
+
+	h = calloc(1, sizeof(struct S3ar));
+	if(h == NULL) {
+		fprintf(stderr, "calloc() for handle failed.\n");
+		return NULL;
+	}
+
+	h->ntargets = opts->ntargets;
+	h->s3artargets = opts->targets;
+	h->aws_path = opts->aws_path;
+	h->targets = calloc(h->ntargets, sizeof(struct Target));
+	if(h->targets == NULL) {
+		fprintf(stderr, "calloc() for targets failed.\n");
+		free(h);
+		return NULL;
+	}
+
+	for(n=0; n<h->ntargets; n++) {
+		t = h->targets + n;
+		t->name = opts->targets[n].name;
+		t->endpoint = opts->targets[n].endpoint;
+		t->bucket = opts->targets[n].bucket;
+		t->aws_key = opts->targets[n].key;
+		t->aws_secret = opts->targets[n].secret;
+		t->aws_path = opts->aws_path;
+		opts->targets[n].failed = 0;
+
+		if(t->endpoint == NULL || t->bucket == NULL || t->aws_key == NULL || t->aws_secret == NULL) {
+			fprintf(stderr, "Incomplete configuration for target %s.\n", t->name != NULL ? t->name : "(default)");
+			s3ar_free(h);
+			return NULL;
+		}
+	}
+
+	if(opts->readcpus != NULL) {
+		if(affinity_parse(&h->readcpus, opts->readcpus) != 0) {
+			fprintf(stderr, "Invalid CPU list %s\n", opts->readcpus);
+			s3ar_free(h);
+			return NULL;
+		}
+
+		h->pinread = 1;
+	}
+
+	if(opts->uploadcpus != NULL && affinity_parse(&h->uploadcpus, opts->uploadcpus) != 0) {
+		fprintf(stderr, "Invalid CPU list %s\n", opts->uploadcpus);
+		s3ar_free(h);
+		return NULL;
+	}
+
+	if(opts->spooldir != NULL) {
+		if(spool_init(&h->spool, opts->spooldir, opts->spoolmax, S3_PUT_BUFSIZ) != 0) {
+			s3ar_free(h);
+			return NULL;
+		}
+
+		h->spooling = 1;
+		h->bufsiz = SPOOL_CHUNKSIZ;
+		h->buffer = malloc(SPOOL_CHUNKSIZ);
+		if(h->buffer == NULL) {
+			fprintf(stderr, "Cannot allocate memory for spool buffer.\n");
+			spool_destroy(&h->spool);
+			s3ar_free(h);
+			return NULL;
+		}
+	} else {
+		h->bufsiz = S3_PUT_BUFSIZ;
+	}
+
+	if(upload_init(&h->up, h->targets, h->ntargets, opts->slack, S3_PUT_BUFSIZ, h->spooling ? &h->spool : NULL, opts->pool != NULL ? &opts->pool->pool : NULL) != 0) {
+		if(h->spooling)
+			spool_destroy(&h->spool);
+		s3ar_free(h);
+		return NULL;
+	}
+
+	if(opts->uploadcpus != NULL)
+		h->up.uploadcpus = &h->uploadcpus;
+
+	if(opts->rollsize > 0 || opts->rolltime > 0)
+		upload_set_rollover(&h->up, opts->rollsize, opts->rolltime);
+
+	if(upload_start(&h->up) != 0) {
+		fprintf(stderr, "Cannot start upload.\n");
+		upload_destroy(&h->up);
+		if(h->spooling)
+			spool_destroy(&h->spool);
+		s3ar_free(h);
+		return NULL;
+	}
+
+	if(h->spooling) {
+		/* Callers write into the spool at disk speed, the loader thread feeds parts to the targets from there */
+		if(pthread_create(&h->loader, NULL, spool_loader, h) != 0) {
+			fprintf(stderr, "Cannot start spool loader thread.\n");
+			upload_abort(&h->up);
+			upload_finish(&h->up);
+			upload_destroy(&h->up);
+			spool_destroy(&h->spool);
+			s3ar_free(h);
+			return NULL;
+		}
+
+		fprintf(stderr, "Spooling to %s (at most %llu bytes)\n", h->spool.dir, opts->spoolmax);
+	}
+
+	h->do_index = opts->index;
+	if(h->do_index)
+		tar_index_init(&h->ti);
+
+	return h;
+}
+
+static void pin_writer(struct S3ar *h) {
+	/* Pin before the first byte lands in a fresh buffer, so its pages are allocated on our node */
+	if(h->pinread && !h->pinned)
+		affinity_apply(&h->readcpus);
+
+	h->pinned = 1;
+}
+
+void *s3ar_reserve(struct S3ar *h, size_t *len) {
+	if(h->failed)
+		return NULL;
+
+	pin_writer(h);
+
+	if(!h->spooling && h->buffer == NULL) {
+		if((h->buffer = upload_buffer(&h->up)) == NULL) {
+			h->failed = 1;
+			return NULL;
+		}
+	}
+
+	*len = h->bufsiz - h->buflen;
+	return h->buffer + h->buflen;
+}
+
+int s3ar_commit(struct S3ar *h, size_t len) {
+	if(h->failed)
+		return 1;
+
+	if(len > h->bufsiz - h->buflen || rollover(h, len) != 0 || consume(h, h->buffer + h->buflen, len) != 0) {
+		h->failed = 1;
+		return 1;
+	}
+
+	h->buflen += len;
+	if(h->buflen == h->bufsiz && flush(h) != 0) {
+		h->failed = 1;
+		return 1;
+	}
+
+	return 0;
+}
+
+ssize_t s3ar_write(struct S3ar *h, const void *buffer, size_t buflen) {
+	const char *p = buffer;
+	size_t done = 0;
+	size_t len;
+	char *dst;
+
+	while(done < buflen) {
+		if((dst = s3ar_reserve(h, &len)) == NULL)
+			return -1;
+
+		if(len > buflen - done)
+			len = buflen - done;
+
+		memcpy(dst, p + done, len);
+		if(s3ar_commit(h, len) != 0)
+			return -1;
+
+		done += len;
+	}
+
+	return done;
+}
+
+ssize_t s3ar_writev(struct S3ar *h, const struct iovec *iov, int iovcnt) {
+	ssize_t done = 0;
+	int i;
+
+	for(i=0; i<iovcnt; i++) {
+		if(s3ar_write(h, iov[i].iov_base, iov[i].iov_len) < 0)
+			return -1;
+		done += iov[i].iov_len;
+	}
+
+	return done;
+}
+
+int s3ar_write_part(struct S3ar *h, void *buffer, size_t buflen, void (*release)(void *buffer, void *arg), void *arg) {
+	ssize_t ret;
+
+	pin_writer(h);
+
+	/* The buffer can only become a part of its own if it lines up with the part boundaries */
+	if(h->spooling || h->buflen > 0 || buflen == 0 || buflen > h->up.partsize) {
+		ret = s3ar_write(h, buffer, buflen);
+		if(release != NULL)
+			release(buffer, arg);
+		return ret < 0 ? 1 : 0;
+	}
+
+	if(h->failed || rollover(h, 0) != 0 || (h->buffer == NULL && upload_slot(&h->up) != 0) || consume(h, buffer, buflen) != 0) {
+		h->failed = 1;
+		if(release != NULL)
+			release(buffer, arg);
+		return 1;
+	}
+
+	/* A buffer reserved for this slot is left unused, the targets read the caller's instead */
+	h->buffer = NULL;
+	upload_end_part(&h->up);
+	upload_publish_ref(&h->up, buffer, buflen, release, arg);
+	return 0;
+}
+
+size_t s3ar_part_size(struct S3ar *h) {
+	return h->up.partsize;
+}
+
+void s3ar_abort(struct S3ar *h) {
+	h->failed = 1;
+}
+
+int s3ar_close(struct S3ar *h, struct S3arResult *result) {
+	int failed;
+	int n;
+
+	if(!h->failed && flush(h) != 0)
+		h->failed = 1;
+
+	if(h->spooling) {
+		if(h->failed || spool_finish(&h->spool) != 0) {
+			fprintf(stderr, "Failed to spool input, aborting.\n");
+			upload_abort(&h->up);
+			spool_abort(&h->spool);
+			h->failed = 1;
+		}
+
+		pthread_join(h->loader, NULL);
+	} else if(h->failed) {
+		upload_abort(&h->up);
+	}
+
+	failed = upload_finish(&h->up);
+	if(h->spooling)
+		spool_destroy(&h->spool);
+
+	if(result != NULL)
+		memset(result, 0, sizeof(struct S3arResult));
+
+	if(!h->failed && failed < h->ntargets && h->do_index && h->ti.state != TAR_INVALID && h->ti.nmembers > 0) {
+		n = upload_index(h);
+		if(n < 0)
+			h->failed = 1;
+		else
+			failed += n;
+
+		if(n >= 0 && result != NULL)
+			result->indexed = h->ti.nmembers;
+	}
+
+	if(result != NULL) {
+		result->bytes = h->up.bytes;
+		memcpy(result->sha256, h->up.hash, sizeof(result->sha256));
+		result->segments = h->up.rollover ? h->up.nsegments : 0;
+		result->failed = h->failed ? h->ntargets : failed;
+		placement(h, result->placement, sizeof(result->placement));
+	}
+
+	for(n=0; n<h->ntargets; n++)
+		h->s3artargets[n].failed = h->failed || h->targets[n].failed;
+
+	n = h->failed || failed > 0;
+	upload_destroy(&h->up);
+	s3ar_free(h);
+	return n;
+}
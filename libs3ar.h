@@ -0,0 +1,115 @@
+/* Copyright (c) 2021 J. von Rotz <jr@vrtz.ch>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Streaming upload library behind the s3ar command.
+ *
+ * A handle reads nothing by itself: the caller pushes the stream with
+ * s3ar_write(), s3ar_writev() or, to avoid copying, s3ar_reserve() and
+ * s3ar_commit() to fill the part buffer in place, or s3ar_write_part() to
+ * upload a buffer it owns as a part of its own. The handle takes care of
+ * part buffering, concurrent uploads to all targets, retries, spooling,
+ * rollover and completion. None of the calls are safe to use on the same
+ * handle from several threads at once.
+ *
+ * s3ar_write_part() hands the buffer to the targets as is and calls
+ * release() once all of them are done with it. This only works on a part
+ * boundary, without spooling and for buffers up to s3ar_part_size(); in
+ * any other case the data is copied and release() is called right away.
+ * As with any multipart upload, every part but the last of an object must
+ * be at least 5 MiB.
+ *
+ * To upload several streams at once, open one handle per stream, each
+ * driven by its own thread, and pass them the same pool from
+ * s3ar_pool_create(). The handles then share a limited number of part
+ * buffers and uploads in flight, handed out to the streams in turn. The
+ * pool must outlive all handles using it.
+ *
+ * With readcpus and uploadcpus, the threads filling and uploading parts
+ * are pinned to the given CPUs. Part buffers are first touched by the
+ * thread filling them, so with the default NUMA policy they end up on the
+ * node that thread runs on; put uploadcpus on the node of the NIC.
+ */
+
+#ifndef LIBS3AR_H
+#define LIBS3AR_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct S3ar;
+struct S3arPool;
+
+struct S3arTarget {
+	char *name;             /* Shown in messages, may be NULL */
+	char *endpoint;
+	char *bucket;
+	char *key;
+	char *secret;
+	int failed;             /* Set by s3ar_close() */
+};
+
+struct S3arOptions {
+	char *aws_path;
+	struct S3arTarget *targets;
+	int ntargets;
+	unsigned int slack;     /* Parts a slow target may lag behind before writes block */
+	char *spooldir;         /* If set, spool to disk below this directory */
+	unsigned long long spoolmax;
+	unsigned long long rollsize; /* Roll over into aws_path.000, ... at this size, 0 for none */
+	unsigned int rolltime;  /* ... or after this many seconds, 0 for none; checked on writes only, an idle stream keeps its object open */
+	short index;            /* Index the stream as tar archive */
+	struct S3arPool *pool;  /* Share buffers and uploads with other handles, may be NULL */
+	char *readcpus;         /* Pin the thread writing to the handle to these CPUs, e.g. "0-7,16-23" */
+	char *uploadcpus;       /* Pin the upload threads, which also do TLS, to these CPUs */
+};
+
+struct S3arResult {
+	unsigned long long bytes;
+	unsigned char sha256[32];
+	unsigned int segments;  /* Objects written, 0 without rollover */
+	size_t indexed;         /* Tar members in the index, 0 if none was written */
+	int failed;             /* Targets which did not complete */
+	char placement[256];    /* CPUs and NUMA nodes the stream was read and uploaded on */
+};
+
+struct S3arPool *s3ar_pool_create(unsigned int buffers, unsigned int transfers);
+void s3ar_pool_destroy(struct S3arPool *pool);
+void s3ar_options_init(struct S3arOptions *opts);
+struct S3ar *s3ar_open(struct S3arOptions *opts);
+void *s3ar_reserve(struct S3ar *h, size_t *len);
+int s3ar_commit(struct S3ar *h, size_t len);
+ssize_t s3ar_write(struct S3ar *h, const void *buffer, size_t buflen);
+ssize_t s3ar_writev(struct S3ar *h, const struct iovec *iov, int iovcnt);
+int s3ar_write_part(struct S3ar *h, void *buffer, size_t buflen, void (*release)(void *buffer, void *arg), void *arg);
+size_t s3ar_part_size(struct S3ar *h);
+void s3ar_abort(struct S3ar *h);
+int s3ar_close(struct S3ar *h, struct S3arResult *result);
+
+#endif
@@ -0,0 +1,146 @@
+/* Copyright (c) 2021 J. von Rotz <jr@vrtz.ch>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "pool.h"
+
+static void waiter_add(struct Pool *pool, struct PoolWaiter **list, struct PoolWaiter *w, struct PoolStream *ps) {
+	w->ps = ps;
+	w->ticket = pool->tickets++;
+	w->next = *list;
+	*list = w;
+}
+
+static void waiter_remove(struct PoolWaiter **list, struct PoolWaiter *w) {
+	while(*list != w)
+		list = &(*list)->next;
+	*list = w->next;
+}
+
+static int waiter_first(struct PoolWaiter *list, struct PoolWaiter *w, short transfers) {
+	unsigned int held = transfers ? w->ps->transfers : w->ps->buffers;
+	unsigned int other;
+
+	/* The stream holding the fewest goes first, the longest waiting among those */
+	for(; list != NULL; list = list->next) {
+		other = transfers ? list->ps->transfers : list->ps->buffers;
+		if(other < held || (other == held && list->ticket < w->ticket))
+			return 0;
+	}
+
+	return 1;
+}
+
+int pool_init(struct Pool *pool, unsigned int maxbuffers, unsigned int maxtransfers, size_t partsize) {
+	memset(pool, 0, sizeof(struct Pool));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pool->partsize = partsize;
+	pool->maxbuffers = maxbuffers > 0 ? maxbuffers : 1;
+	pool->maxtransfers = maxtransfers > 0 ? maxtransfers : 1;
+	pool->free = calloc(pool->maxbuffers, sizeof(char *));
+
+	if(pool->free == NULL) {
+		fprintf(stderr, "calloc() for buffer pool failed.\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+char *pool_get(struct Pool *pool, struct PoolStream *ps) {
+	struct PoolWaiter w;
+	char *buffer = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	waiter_add(pool, &pool->bufwaiters, &w, ps);
+	while((pool->nfree == 0 && pool->nbuffers == pool->maxbuffers) || !waiter_first(pool->bufwaiters, &w, 0))
+		pthread_cond_wait(&pool->cond, &pool->lock);
+	waiter_remove(&pool->bufwaiters, &w);
+
+	/* Buffers are only allocated once a stream actually needs one */
+	if(pool->nfree > 0)
+		buffer = pool->free[--pool->nfree];
+	else if((buffer = malloc(pool->partsize)) != NULL)
+		pool->nbuffers++;
+	else
+		fprintf(stderr, "Cannot allocate memory for buffer.\n");
+
+	if(buffer != NULL)
+		ps->buffers++;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	return buffer;
+}
+
+void pool_put(struct Pool *pool, struct PoolStream *ps, char *buffer) {
+	pthread_mutex_lock(&pool->lock);
+	pool->free[pool->nfree++] = buffer;
+	ps->buffers--;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_begin(struct Pool *pool, struct PoolStream *ps) {
+	struct PoolWaiter w;
+
+	pthread_mutex_lock(&pool->lock);
+	waiter_add(pool, &pool->xferwaiters, &w, ps);
+	while(pool->transfers == pool->maxtransfers || !waiter_first(pool->xferwaiters, &w, 1))
+		pthread_cond_wait(&pool->cond, &pool->lock);
+	waiter_remove(&pool->xferwaiters, &w);
+	pool->transfers++;
+	ps->transfers++;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_end(struct Pool *pool, struct PoolStream *ps) {
+	pthread_mutex_lock(&pool->lock);
+	pool->transfers--;
+	ps->transfers--;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_destroy(struct Pool *pool) {
+	unsigned int i;
+
+	for(i=0; i<pool->nfree; i++)
+		free(pool->free[i]);
+
+	free(pool->free);
+	pool->free = NULL;
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->cond);
+}
@@ -0,0 +1,69 @@
+/* Copyright (c) 2021 J. von Rotz <jr@vrtz.ch>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <pthread.h>
+
+/* Shared by several concurrent uploads: part buffers and upload slots are
+ * handed out to whichever waiting stream currently holds the fewest, so the
+ * streams take turns instead of racing each other.
+ */
+
+struct PoolStream {
+	unsigned int buffers;   /* Buffers held by this stream */
+	unsigned int transfers; /* Parts of this stream being uploaded */
+};
+
+struct PoolWaiter {
+	struct PoolStream *ps;
+	unsigned long ticket;
+	struct PoolWaiter *next;
+};
+
+struct Pool {
+	size_t partsize;
+	unsigned int maxbuffers;
+	unsigned int nbuffers;  /* Buffers allocated so far */
+	char **free;
+	unsigned int nfree;
+	unsigned int maxtransfers;
+	unsigned int transfers;
+	unsigned long tickets;
+	struct PoolWaiter *bufwaiters;
+	struct PoolWaiter *xferwaiters;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+int pool_init(struct Pool *pool, unsigned int maxbuffers, unsigned int maxtransfers, size_t partsize);
+char *pool_get(struct Pool *pool, struct PoolStream *ps);
+void pool_put(struct Pool *pool, struct PoolStream *ps, char *buffer);
+void pool_begin(struct Pool *pool, struct PoolStream *ps);
+void pool_end(struct Pool *pool, struct PoolStream *ps);
+void pool_destroy(struct Pool *pool);
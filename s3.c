@@ -30,7 +30,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
+#include <pthread.h>
 #include <curl/curl.h>
 #include <openssl/hmac.h>
 #include "s3.h"
@@ -40,149 +42,184 @@ size_t read_callback(char *ptr, size_t size, size_t nmemb, void *userp);
 size_t header_callback(char *buffer, size_t size, size_t nmemb, void *userp);
 size_t write_callback(void *data, size_t size, size_t nmemb, void *userp);
 
-char *strip_content_type(char *contenttype) {
-	char *result;
-	int i, len;
+static pthread_once_t curl_once = PTHREAD_ONCE_INIT;
+static CURLcode curl_init_res;
 
-	len = strlen(contenttype);
-	result = malloc(len+1);
-	if(result == NULL) {
-		fprintf(stderr, "malloc() failed\n");
-		return NULL;
+static pthread_mutex_t curl_idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static CURL *curl_idle[S3_MAX_IDLE_CONN];
+static int curl_nidle;
+
+static void s3_curl_init(void) {
+	/* curl_global_init() is not thread-safe, so do it exactly once for all uploaders */
+	curl_init_res = curl_global_init(CURL_GLOBAL_DEFAULT);
+}
+
+static CURL *s3_curl_get(void) {
+	CURL *curl = NULL;
+
+	/* Reuse an idle handle, along with its open connection, from whichever thread used it last */
+	pthread_mutex_lock(&curl_idle_lock);
+	if(curl_nidle > 0)
+		curl = curl_idle[--curl_nidle];
+	pthread_mutex_unlock(&curl_idle_lock);
+
+	if(curl != NULL) {
+		curl_easy_reset(curl);
+		return curl;
 	}
 
-	for(i=0; i<len; i++) {
-		if(contenttype[i] == ';') {
-			result[i] = '\0';
-			break;
-		}
-		
-		result[i] = contenttype[i];
+	return curl_easy_init();
+}
+
+static void s3_curl_put(CURL *curl) {
+	pthread_mutex_lock(&curl_idle_lock);
+	if(curl_nidle < S3_MAX_IDLE_CONN) {
+		curl_idle[curl_nidle++] = curl;
+		curl = NULL;
 	}
+	pthread_mutex_unlock(&curl_idle_lock);
 
-	result[len] = '\0';
-	return result;
+	if(curl != NULL)
+		curl_easy_cleanup(curl);
 }
 
-char *strip_etag(char *etag, size_t etlen) {
+char *strip_etag(const char *etag, size_t etlen) {
+	const char *end = etag + etlen;
 	char *result;
-	int i;
-	int trim = 6;
-	int skip = 0;
+	size_t len = 0;
 
-	result = malloc(etlen+1-trim);
+	/* Take the value of an "ETag: ..." header line without its quotes, in one pass */
+	if(etlen >= 5 && strncasecmp(etag, "ETag:", 5) == 0)
+		etag += 5;
 
+	while(etag < end && (*etag == ' ' || *etag == '\t'))
+		etag++;
+
+	result = malloc(end - etag + 1);
 	if(result == NULL) {
 		fprintf(stderr, "malloc() failed\n");
 		return NULL;
 	}
 
+	for(; etag < end && *etag != '\r' && *etag != '\n' && *etag != '\0'; etag++) {
+		if(*etag != '"')
+			result[len++] = *etag;
+	}
 
-	for(i=0+trim; i<etlen; i++) {
-		if(etag[i] == '"') {
-			skip++;
-			continue;
-		}
+	result[len] = '\0';
+	return result;
+}
 
-		if(etag[i] == '\r' || etag[i] == '\n' || etag[i] == '\0') {
-			result[i-trim-skip] = '\0';
-			break;
+const char *s3_xml_value(const char *xml, const char *tag, size_t *vallen) {
+	const char *p = xml;
+	const char *end;
+	size_t taglen = strlen(tag);
+
+	/* First <tag>value</tag> in a response, without copying or modifying it */
+	while((p = strchr(p, '<')) != NULL) {
+		p++;
+		if(strncmp(p, tag, taglen) == 0 && p[taglen] == '>') {
+			p += taglen + 1;
+			if((end = strchr(p, '<')) == NULL)
+				return NULL;
+
+			*vallen = end - p;
+			return p;
 		}
-		result[i-trim-skip] = etag[i];
 	}
 
-	result[etlen+1-trim-skip] = '\0';
-	return result;
+	return NULL;
+}
+
+int s3_string_to_sign(char *buf, size_t buflen, const char *method, const char *contenttype, const char *date, const char *bucket, const char *path, const char *getparms) {
+	if(getparms != NULL && getparms[0] != '\0')
+		return snprintf(buf, buflen, "%s\n\n%s\n%s\n/%s%s?%s", method, contenttype, date, bucket, path, getparms);
+
+	return snprintf(buf, buflen, "%s\n\n%s\n%s\n/%s%s", method, contenttype, date, bucket, path);
+}
+
+int s3_sign(char *sig, const char *secret, const char *tosign, size_t tosignlen) {
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int md_len = 0;
+
+	/* sig needs room for S3_SIGNATURE_SIZE bytes */
+	if(HMAC(EVP_sha1(), secret, strlen(secret), (const unsigned char *)tosign, tosignlen, md, &md_len) == NULL)
+		return 1;
+
+	base64_encode_into(md, md_len, sig);
+	return 0;
 }
 
-int s3_talk(char *endpoint, char *bucket, char *aws_path, char *method, char *getparms, char *key, char *secret, char *contenttype, unsigned char *buffer, size_t buflen, char **responsehdr, size_t *responsehdrsiz) {
-	char *signature;
+int s3_talk(char *endpoint, char *bucket, char *aws_path, char *method, char *getparms, char *key, char *secret, char *contenttype, unsigned char *buffer, size_t buflen, char *range, FILE *outfile, char **responsehdr, size_t *responsehdrsiz) {
 	char datestr[100];
-	char *b64str;
 	char authhdr[BUFSIZ];
 	char datehdr[BUFSIZ];
 	char hosthdr[BUFSIZ];
 	char conthdr[BUFSIZ];
 	char pathstr[BUFSIZ];
 	char requrl[BUFSIZ];
-	char *stripped_ct;
-	char *etagstr = NULL;
-	int bytes_free;
+	char m[BUFSIZ];
+	char sig[S3_SIGNATURE_SIZE];
+	int mlen;
+	long status = 0;
 	CURL *curl;
 	CURLcode res;
 
 	time_t now = time(NULL);
-	struct tm *t = gmtime(&now);
-
-	unsigned char *m;
-	unsigned char *md;
-	unsigned int md_len;
-	size_t sl;
+	struct tm tmbuf;
+	struct tm *t = gmtime_r(&now, &tmbuf);
 
 	struct WriteThis wt;
 	struct ETagHeader et;
+	et.buffer = NULL;
 	et.buflen = 0;
 	struct ResponseBuffer resbuf;
 	resbuf.size = 0;
 
-	bytes_free = BUFSIZ;
 	strncpy(pathstr, aws_path, BUFSIZ-1);
 	pathstr[BUFSIZ-1] = '\0';
-	sl = strlen(pathstr);
-	
-	m = malloc(BUFSIZ);
-	md = calloc(EVP_MAX_MD_SIZE, sizeof(char));
-
-	if(m == NULL) {
-		fprintf(stderr, "malloc() failed\n");
-		return 1;
-	}
-
-	if(md == NULL) {
-		fprintf(stderr, "malloc() failed\n");
-		return 1;
-	}
-
-	stripped_ct = strip_content_type(contenttype);
-	if(stripped_ct == NULL) {
-		fprintf(stderr, "strip_content_type() failed\n");
-		return 1;
-	}
 
 	strftime(datestr, sizeof(datestr)-1, "%a, %d %b %Y %T %z", t);
 	snprintf(datehdr, BUFSIZ, "Date: %s", datestr);
 
-	if(strlen(getparms) > 0) {
-		snprintf(requrl, BUFSIZ, "https://%s.%s%s?%s", bucket, endpoint, pathstr, getparms);
-		snprintf(m, BUFSIZ, "%s\n\n%s\n%s\n/%s%s?%s", method, contenttype, datestr, bucket, pathstr, getparms); 
-	} else {
-		snprintf(requrl, BUFSIZ, "https://%s.%s%s", bucket, endpoint, pathstr);
-		snprintf(m, BUFSIZ, "%s\n\n%s\n%s\n/%s%s", method, contenttype, datestr, bucket, pathstr);
+	if(strlen(getparms) > 0)
+		snprintf(requrl, BUFSIZ, S3_SCHEME "://%s.%s%s?%s", bucket, endpoint, pathstr, getparms);
+	else
+		snprintf(requrl, BUFSIZ, S3_SCHEME "://%s.%s%s", bucket, endpoint, pathstr);
+
+	mlen = s3_string_to_sign(m, sizeof(m), method, contenttype, datestr, bucket, pathstr, getparms);
+	if(mlen < 0 || mlen >= sizeof(m)) {
+		fprintf(stderr, "Request for %s too long to sign\n", pathstr);
+		return 1;
 	}
 
 #ifdef S3ARDEBUG
 	fprintf(stderr, " -- s3_talk: Contents of m:\n%s\n -- s3_talk: End contents of m\n\n", m);
 #endif
-	HMAC(EVP_sha1(), secret, strlen(secret), m, strlen(m), md, &md_len);
-	b64str = base64_encode(md, md_len);
-	snprintf(authhdr, BUFSIZ, "Authorization: AWS %s:%s", key, b64str);
-	res = curl_global_init(CURL_GLOBAL_DEFAULT);
+	if(s3_sign(sig, secret, m, mlen) != 0) {
+		fprintf(stderr, "HMAC() failed\n");
+		return 1;
+	}
+
+	snprintf(authhdr, BUFSIZ, "Authorization: AWS %s:%s", key, sig);
+	pthread_once(&curl_once, s3_curl_init);
+	res = curl_init_res;
 	
 	if(res != CURLE_OK) {
 		fprintf(stderr, "curl_global_init() failed: %s\n", curl_easy_strerror(res));
 		return 1;
 	}
 
-	curl = curl_easy_init();
+	curl = s3_curl_get();
 
 	if(!curl) {
-		curl_global_cleanup();
 		fprintf(stderr, "curl_easy_init() failed\n");
 		return 1;
 	}
 
 	snprintf(hosthdr, BUFSIZ, "Host: %s.%s", bucket, endpoint);
 	curl_easy_setopt(curl, CURLOPT_URL, requrl);
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
 
 	if(strncmp(method, "POS", 3) == 0) {
 		resbuf.response = NULL;
@@ -200,10 +237,31 @@ int s3_talk(char *endpoint, char *bucket, char *aws_path, char *method, char *ge
 		curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, buflen);
 		curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_callback);
 		curl_easy_setopt(curl, CURLOPT_HEADERDATA, &et);
+		/* Collect error bodies rather than letting curl print them to stdout */
+		resbuf.response = NULL;
+		resbuf.size = 0;
+		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&resbuf);
 	} else if(strncmp(method, "DEL", 3) == 0) {
+		resbuf.response = NULL;
+		resbuf.size = 0;
 		curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
+		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&resbuf);
 	} else {
 		curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+		curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+		if(range != NULL)
+			curl_easy_setopt(curl, CURLOPT_RANGE, range);
+
+		if(outfile != NULL) {
+			curl_easy_setopt(curl, CURLOPT_WRITEDATA, outfile);
+		} else {
+			resbuf.response = NULL;
+			resbuf.size = 0;
+			curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
+			curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&resbuf);
+		}
 	}
 
 	struct curl_slist *sendheaders = NULL;
@@ -211,7 +269,7 @@ int s3_talk(char *endpoint, char *bucket, char *aws_path, char *method, char *ge
 	sendheaders = curl_slist_append(sendheaders, datehdr);
 	sendheaders = curl_slist_append(sendheaders, hosthdr);
 
-	if(contenttype) {
+	if(contenttype && contenttype[0] != '\0') {
 		snprintf(conthdr, BUFSIZ, "Content-Type: %s", contenttype);
 		sendheaders = curl_slist_append(sendheaders, conthdr);
 	}
@@ -224,14 +282,26 @@ int s3_talk(char *endpoint, char *bucket, char *aws_path, char *method, char *ge
 	res = curl_easy_perform(curl);
 
 	if(res != CURLE_OK) {
-		curl_global_cleanup();
 		fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
 		curl_slist_free_all(sendheaders);
 		curl_easy_cleanup(curl);
-		curl_global_cleanup();
 		if(et.buffer) {
 			free(et.buffer);
 		}
+		if(resbuf.size > 0)
+			free(resbuf.response);
+		return 1;
+	}
+
+	/* A reply, even an error, means the connection is fine, but only 2xx means the request worked */
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+	if(status < 200 || status > 299) {
+		fprintf(stderr, "%s %s failed with HTTP status %ld%s%.*s\n", method, pathstr, status, resbuf.size > 0 ? ": " : "", (int)(resbuf.size > 512 ? 512 : resbuf.size), resbuf.size > 0 ? resbuf.response : "");
+		curl_slist_free_all(sendheaders);
+		s3_curl_put(curl);
+		free(et.buffer);
+		if(resbuf.size > 0)
+			free(resbuf.response);
 		return 1;
 	}
 
@@ -242,9 +312,9 @@ int s3_talk(char *endpoint, char *bucket, char *aws_path, char *method, char *ge
 #ifdef S3ARDEBUG
 		fprintf(stderr, " -- s3_talk: Content of et.buffer:\n%s\n -- s3_talk: End of content of et.buffer\n\n", et.buffer);
 #endif
-	}
-
-	if(resbuf.size > 0) {
+		if(resbuf.size > 0)
+			free(resbuf.response);
+	} else if(resbuf.size > 0) {
 		/* Get XML (or any other) response */
 		*responsehdr = resbuf.response;
 		*responsehdrsiz = resbuf.size;
@@ -253,52 +323,39 @@ int s3_talk(char *endpoint, char *bucket, char *aws_path, char *method, char *ge
 #endif
 	}
 
-	free(stripped_ct);
-	free(m);
-	free(md);
-	free(b64str);
 	curl_slist_free_all(sendheaders);
-	curl_easy_cleanup(curl);
-	curl_global_cleanup();
+	s3_curl_put(curl);
 	return 0;
 }
 
 int s3_initpart(char *endpoint, char *bucket, char *aws_path, char *key, char *secret, char **uploadId, size_t *uidsiz) {
-	char *response;
-	char *sep;
-        char *orig;
-	char *tmp;
-	size_t responselen;
-        short takenext = 0;
-	char *request = calloc(strlen(aws_path) + 9, sizeof(char));
-	snprintf(request, strlen(aws_path) + 9, "%s?uploads", aws_path);
-	s3_talk(endpoint, bucket, request, "POST", "", key, secret, "text/plain", NULL, 0, &response, &responselen); 
+	char request[BUFSIZ];
+	char *response = NULL;
+	const char *value;
+	size_t responselen = 0;
+	size_t valuelen;
+
+	*uploadId = NULL;
+	*uidsiz = 0;
+	snprintf(request, sizeof(request), "%s?uploads", aws_path);
+	s3_talk(endpoint, bucket, request, "POST", "", key, secret, "text/plain", NULL, 0, NULL, NULL, &response, &responselen); 
 
 	/* Get UploadId */
-	if(responselen > 0) {
-		orig = response;
-		while((sep = strsep(&response, ">")) != NULL) {
-			if(takenext == 1) {
-				tmp = strsep(&sep, "<");
-				*uidsiz = strlen(tmp)+1;
-				*uploadId = calloc(*uidsiz, sizeof(char));
-				if(*uploadId == NULL) {
-					fprintf(stderr, "calloc() for uploadId failed.\n");
-					return 1;
-				}
-
-				strcpy(*uploadId, tmp);
-				break;
-			}
-
-			if(strcmp(sep, "<UploadId") == 0)
-				takenext = 1;
+	if(responselen > 0 && (value = s3_xml_value(response, "UploadId", &valuelen)) != NULL) {
+		*uploadId = malloc(valuelen + 1);
+		if(*uploadId == NULL) {
+			fprintf(stderr, "malloc() for uploadId failed.\n");
+			free(response);
+			return 1;
 		}
 
-		free(orig);
-		orig = response = NULL;
+		memcpy(*uploadId, value, valuelen);
+		(*uploadId)[valuelen] = '\0';
+		*uidsiz = valuelen + 1;
 	}
-	free(request);
+
+	free(response);
+	return 0;
 }
 
 int s3_putpart(char *endpoint, char *bucket, char *aws_path, char *key, char *secret, char *uploadid, unsigned int partnum, char *buffer, size_t buflen, char **responsehdr, size_t *responsehdrsiz) {
@@ -308,7 +365,7 @@ int s3_putpart(char *endpoint, char *bucket, char *aws_path, char *key, char *se
 	int ret = 0;
 
 	snprintf(getparms, BUFSIZ-1, "partNumber=%d&uploadId=%s", partnum, uploadid);
-	ret = s3_talk(endpoint, bucket, aws_path, "PUT", getparms, key, secret, "application/octet-stream", buffer, buflen, &etagstr, &etagstrlen); 
+	ret = s3_talk(endpoint, bucket, aws_path, "PUT", getparms, key, secret, "application/octet-stream", buffer, buflen, NULL, NULL, &etagstr, &etagstrlen); 
 
 	if(ret != 0) {
 		free(etagstr);
@@ -316,13 +373,9 @@ int s3_putpart(char *endpoint, char *bucket, char *aws_path, char *key, char *se
 	}
 
 	if(etagstrlen > 0) {
-		*responsehdr = strip_etag(etagstr, etagstrlen);
-		free(etagstr);
-		if(*responsehdr == NULL) {
-			fprintf(stderr, "strip_etag() failed.\n");
-			return 1;
-		}
-		*responsehdrsiz = strlen(*responsehdr);
+		/* Already stripped by header_callback() */
+		*responsehdr = etagstr;
+		*responsehdrsiz = etagstrlen;
 	} else {
 		fprintf(stderr, " -- s3_putpart: etagstrlen not greater than zero, assuming error\n");
 		return 1;
@@ -344,6 +397,8 @@ int s3_completepart(char *endpoint, char *bucket, char *aws_path, char *key, cha
 	int getparmlen = 0;
 	int ret;
 	struct ETag *curr_et;
+	const char *code;
+	size_t codelen;
 
 	unsigned char initbody[] = "<?xml version=\"1.0\" encoding=\"UTF-8\"?><CompleteMultipartUpload>";
 	unsigned char initpart[] = "<Part>";
@@ -403,6 +458,7 @@ int s3_completepart(char *endpoint, char *bucket, char *aws_path, char *key, cha
 		tmpbuf = NULL;
 		strncat(buffer, numbuf, numbuflen);
                 free(curr_et->buffer);
+		curr_et->buffer = NULL;
 	}
 
 	buflen += strlen(endbody);
@@ -422,13 +478,61 @@ int s3_completepart(char *endpoint, char *bucket, char *aws_path, char *key, cha
 	fprintf(stderr, " -- s3_completepart: Content of buffer:\n%s\n -- s3_completepart: End of content of buffer\n\n", buffer);
 #endif
 	/* buflen -1: We are transferring raw bytes, so terminating NULL character would be included, which results in a malformed XML */
-	ret = s3_talk(endpoint, bucket, aws_path, "POST", getparms, key, secret, "multipart/form-data;", buffer, buflen-1, &response, &responselen); 
+	ret = s3_talk(endpoint, bucket, aws_path, "POST", getparms, key, secret, "multipart/form-data;", buffer, buflen-1, NULL, NULL, &response, &responselen); 
+	/* S3 may also report a failed Complete in the body of a 200 reply */
+	if(ret == 0 && response != NULL && strstr(response, "<Error>") != NULL) {
+		code = s3_xml_value(response, "Code", &codelen);
+		fprintf(stderr, "MultipartUploadComplete for %s failed: %.*s\n", aws_path, code != NULL ? (int)codelen : 7, code != NULL ? code : "unknown");
+		ret = 1;
+	}
+
 	if(ret != 0) {
 		fprintf(stderr, "Failed to send MultipartUploadComplete request, you might want to send it manually again. See above output for ETags for each part number.\n");
 	}
 	free(getparms);
 	free(buffer);
 	free(response);
+	return ret;
+}
+
+int s3_abortpart(char *endpoint, char *bucket, char *aws_path, char *key, char *secret, char *uploadid) {
+	char getparms[BUFSIZ];
+	char *response = NULL;
+	size_t responselen = 0;
+	int ret;
+
+	snprintf(getparms, BUFSIZ-1, "uploadId=%s", uploadid);
+	ret = s3_talk(endpoint, bucket, aws_path, "DELETE", getparms, key, secret, "", NULL, 0, NULL, NULL, &response, &responselen);
+	free(response);
+	return ret;
+}
+
+int s3_putobject(char *endpoint, char *bucket, char *aws_path, char *key, char *secret, char *contenttype, char *buffer, size_t buflen) {
+	char *etagstr = NULL;
+	size_t etagstrlen = 0;
+	int ret;
+
+	ret = s3_talk(endpoint, bucket, aws_path, "PUT", "", key, secret, contenttype, buffer, buflen, NULL, NULL, &etagstr, &etagstrlen);
+	free(etagstr);
+
+	if(ret != 0 || etagstrlen == 0) {
+		fprintf(stderr, " -- s3_putobject: No ETag returned for %s, assuming error\n", aws_path);
+		return 1;
+	}
+
+	return 0;
+}
+
+int s3_getobject(char *endpoint, char *bucket, char *aws_path, char *key, char *secret, unsigned long long offset, unsigned long long length, FILE *outfile, char **response, size_t *responselen) {
+	char range[64];
+	char *rangeptr = NULL;
+
+	if(length > 0) {
+		snprintf(range, sizeof(range), "%llu-%llu", offset, offset + length - 1);
+		rangeptr = range;
+	}
+
+	return s3_talk(endpoint, bucket, aws_path, "GET", "", key, secret, "", NULL, 0, rangeptr, outfile, response, responselen);
 }
 
 size_t read_callback(char *dest, size_t size, size_t nmemb, void *userp) {
@@ -454,16 +558,16 @@ size_t read_callback(char *dest, size_t size, size_t nmemb, void *userp) {
 size_t header_callback(char *buffer, size_t size, size_t nmemb, void *userp) {
 	struct ETagHeader *et = (struct ETagHeader *)userp;
 
-	if(strncmp("ETag: ", buffer, 6) == 0) {
-		et->buffer = calloc(nmemb+1, size);
+	if(nmemb*size >= 5 && strncasecmp("ETag:", buffer, 5) == 0) {
+		free(et->buffer);
+		et->buffer = strip_etag(buffer, nmemb*size);
 
 		if(et->buffer == NULL) {
-			fprintf(stderr, "calloc() for et->buffer failed.\n");
+			fprintf(stderr, "strip_etag() failed.\n");
 			return 0;
 		}
 
-		memcpy(et->buffer, buffer, nmemb*size); 
-		et->buflen = nmemb*size;
+		et->buflen = strlen(et->buffer);
 	}
 	return nmemb;
 }
@@ -32,6 +32,12 @@
 #define S3_MAX_PART 16384
 #define S3_MAX_UPLOAD_RETRY 3
 #define S3_UPLOAD_RETRY_WAIT 5
+#define S3_MAX_IDLE_CONN 64 /* Handles kept around with their connections for reuse */
+#define S3_SIGNATURE_SIZE 29 /* Base64 of an HMAC-SHA1, plus NUL */
+
+#ifndef S3_SCHEME
+#define S3_SCHEME "https"
+#endif
 
 struct WriteThis {
 	const char *readptr;
@@ -54,7 +60,14 @@ struct ResponseBuffer {
 	size_t size;
 };
 
-int s3_talk(char *endpoint, char *bucket, char *aws_path, char *method, char *getparms, char *key, char *secret, char *contenttype, unsigned char *buffer, size_t buflen, char **responsehdr, size_t *responsehdrsiz);
+char *strip_etag(const char *etag, size_t etlen);
+const char *s3_xml_value(const char *xml, const char *tag, size_t *vallen);
+int s3_string_to_sign(char *buf, size_t buflen, const char *method, const char *contenttype, const char *date, const char *bucket, const char *path, const char *getparms);
+int s3_sign(char *sig, const char *secret, const char *tosign, size_t tosignlen);
+int s3_talk(char *endpoint, char *bucket, char *aws_path, char *method, char *getparms, char *key, char *secret, char *contenttype, unsigned char *buffer, size_t buflen, char *range, FILE *outfile, char **responsehdr, size_t *responsehdrsiz);
 int s3_putpart(char *endpoint, char *bucket, char *aws_path, char *key, char *secret, char *uploadid, unsigned int partnum, char *buffer, size_t buflen, char **responsehdr, size_t *responsehdrsiz);
 int s3_initpart(char *endpoint, char *bucket, char *aws_path, char *key, char *secret, char **uploadId, size_t *uidlen);
 int s3_completepart(char *endpoint, char *bucket, char *aws_path, char *key, char *secret, char *uploadid, struct ETag *et, size_t partnum);
+int s3_abortpart(char *endpoint, char *bucket, char *aws_path, char *key, char *secret, char *uploadid);
+int s3_putobject(char *endpoint, char *bucket, char *aws_path, char *key, char *secret, char *contenttype, char *buffer, size_t buflen);
+int s3_getobject(char *endpoint, char *bucket, char *aws_path, char *key, char *secret, unsigned long long offset, unsigned long long length, FILE *outfile, char **response, size_t *responselen);
@@ -31,146 +31,697 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <openssl/sha.h>
 #include "s3.h"
+#include "tar.h"
+#include "spool.h"
+#include "upload.h"
+#include "libs3ar.h"
 
-int main(int argc, char *argv[]) {
-	char *endpoint;
-	char *bucket;
-	char *aws_key;
-	char *aws_secret;
-	char *uploadId = NULL;
-	size_t uploadIdLen = 0;
-	char *responsehdr = NULL;
-	size_t rhlen = 0;
-	unsigned int partnum = 0;
-	unsigned int i;
-	int ret = 1;
-	char *buffer;
-	size_t buflen;
-	long long unsigned int bufsum = 0;
-	struct ETag *et = NULL;
-	struct ETag *curr_et = NULL;
-	short oktocomplete = 1;
-	int c;
-	SHA256_CTX sha256;
-	unsigned char hash[SHA256_DIGEST_LENGTH];
+struct Range {
+	unsigned long long start;
+	unsigned long long end;
+};
 
-	if(argc < 2) {
-		fprintf(stderr, "Missing aws_path (/foo.xyz)\n");
-		return(1);
+struct Stream {
+	char *input;            /* NULL for stdin */
+	char *aws_path;
+	struct S3arOptions opts;
+	struct S3arTarget *targets;
+	struct S3arResult result;
+	int ret;
+	pthread_t thread;
+};
+
+struct SegmentObject {
+	char *path;
+	unsigned long long start; /* Offset of this segment within the stream */
+	unsigned long long size;
+};
+
+static void usage(void) {
+	fprintf(stderr, "Usage: s3ar [-i] [-s spooldir [-S spoolsize]] [-T target]... [-l slack] [-r size] [-R seconds] aws_path\n");
+	fprintf(stderr, "       s3ar [options] [-b buffers] [-c uploads] input:/aws_path input:/aws_path...\n");
+	fprintf(stderr, "       s3ar [-T target] -x aws_path member...\n");
+	fprintf(stderr, "  -i  Index the tar stream read from stdin and upload the index to aws_path%s\n", TAR_INDEX_SUFFIX);
+	fprintf(stderr, "  -r  Roll over into aws_path.000, aws_path.001, ... whenever an object reaches this size, e.g. 1T\n");
+	fprintf(stderr, "  -R  Roll over into the next object after this many seconds, checked only while data arrives\n");
+	fprintf(stderr, "  -l  Parts a slow target may lag behind before reading stdin stalls (default: %d)\n", UPLOAD_DEFAULT_SLACK);
+	fprintf(stderr, "  -s  Drain stdin into a spool below spooldir and upload from there\n");
+	fprintf(stderr, "  -S  Maximum disk space used by the spool, e.g. 20G (default: %lluG)\n", SPOOL_DEFAULT_MAX >> 30);
+	fprintf(stderr, "  -T  Upload to the target configured in S3AR_<target>_* variables, may be repeated\n");
+	fprintf(stderr, "  -b  Part buffers shared by all input streams (default: 3 for every 2 streams)\n");
+	fprintf(stderr, "  -c  Parts uploaded at the same time across all input streams (default: no limit)\n");
+	fprintf(stderr, "  -A  Pin a stage to CPUs, e.g. read=0-7 or upload=8-15, may be repeated\n");
+	fprintf(stderr, "  -x  Extract the given members of an indexed tar archive to stdout\n");
+	fprintf(stderr, "An input is a file, FIFO, file descriptor number or - for stdin.\n");
+}
+
+static unsigned long long parse_size(char *str) {
+	char *end;
+	unsigned long long size = strtoull(str, &end, 10);
+
+	switch(*end) {
+	case 'k':
+	case 'K':
+		size <<= 10;
+		end++;
+		break;
+	case 'm':
+	case 'M':
+		size <<= 20;
+		end++;
+		break;
+	case 'g':
+	case 'G':
+		size <<= 30;
+		end++;
+		break;
+	case 't':
+	case 'T':
+		size <<= 40;
+		end++;
+		break;
 	}
 
-	endpoint = getenv("S3AR_ENDPOINT");
-	bucket = getenv("S3AR_BUCKET");
-	aws_key = getenv("S3AR_KEY");
-	aws_secret = getenv("S3AR_SECRET");
+	if(*end != '\0')
+		return 0;
+
+	return size;
+}
+
+static char *target_env(char *name, char *var) {
+	char envname[BUFSIZ];
+	char *value;
+
+	if(name != NULL) {
+		snprintf(envname, sizeof(envname), "S3AR_%s_%s", name, var);
+		if((value = getenv(envname)) != NULL)
+			return value;
+	}
+
+	snprintf(envname, sizeof(envname), "S3AR_%s", var);
+	return getenv(envname);
+}
+
+static int target_from_env(struct Target *t, char *name, char *aws_path) {
+	char *prefix = name != NULL ? name : "";
+	char *sep = name != NULL ? "_" : "";
+
+	memset(t, 0, sizeof(struct Target));
+	t->name = name;
+	t->aws_path = aws_path;
+	t->endpoint = target_env(name, "ENDPOINT");
+	t->bucket = target_env(name, "BUCKET");
+	t->aws_key = target_env(name, "KEY");
+	t->aws_secret = target_env(name, "SECRET");
+
+	if(t->endpoint == NULL) {
+		fprintf(stderr, "Missing endpoint address. Please provide address in environment variable S3AR_%s%sENDPOINT.\n", prefix, sep);
+		return 1;
+	}
 
-	if(endpoint == NULL) {
-		fprintf(stderr, "Missing endpoint address. Please provide address in environment variable S3AR_ENDPOINT.\n");
-		exit(EXIT_FAILURE);
+	if(t->bucket == NULL) {
+		fprintf(stderr, "Missing bucket name. Please provide name in environment variable S3AR_%s%sBUCKET.\n", prefix, sep);
+		return 1;
 	}
 
-	if(bucket == NULL) {
-		fprintf(stderr, "Missing bucket name. Please provide name in environment variable S3AR_BUCKET.\n");
-		exit(EXIT_FAILURE);
+	if(t->aws_key == NULL) {
+		fprintf(stderr, "Missing S3 key. Please provide key in environment variable S3AR_%s%sKEY.\n", prefix, sep);
+		return 1;
 	}
 
-	if(aws_key == NULL) {
-		fprintf(stderr, "Missing S3 key. Please provide key in environment variable S3AR_KEY.\n");
-		exit(EXIT_FAILURE);
+	if(t->aws_secret == NULL) {
+		fprintf(stderr, "Missing S3 secret. Please provide secret in environment variable S3AR_%s%sSECRET.\n", prefix, sep);
+		return 1;
 	}
 
-	if(aws_secret == NULL) {
-		fprintf(stderr, "Missing S3 secret. Please provide secret in environment variable S3AR_SECRET.\n");
-		exit(EXIT_FAILURE);
+	return 0;
+}
+
+static int load_segments(struct Target *t, struct SegmentObject **segs, size_t *nsegs) {
+	char *path;
+	char *response = NULL;
+	char *line;
+	char *eol;
+	char *p;
+	size_t responselen = 0;
+	size_t len;
+	size_t maglen = strlen(UPLOAD_SEGMENTS_MAGIC);
+	unsigned long long offset = 0;
+	struct SegmentObject *tmp;
+
+	len = strlen(t->aws_path) + strlen(UPLOAD_SEGMENTS_SUFFIX) + 1;
+	path = malloc(len);
+	if(path == NULL) {
+		fprintf(stderr, "malloc() for manifest path failed.\n");
+		return 1;
 	}
 
-	s3_initpart(endpoint, bucket, argv[1], aws_key, aws_secret, &uploadId, &uploadIdLen);
-	SHA256_Init(&sha256);
+	snprintf(path, len, "%s%s", t->aws_path, UPLOAD_SEGMENTS_SUFFIX);
+	if(s3_getobject(t->endpoint, t->bucket, path, t->aws_key, t->aws_secret, 0, 0, NULL, &response, &responselen) != 0 || response == NULL) {
+		fprintf(stderr, "Cannot fetch segment manifest %s.\n", path);
+		free(path);
+		return 1;
+	}
 
-	if(uploadIdLen < 1 || uploadId == NULL) {
-		fprintf(stderr, "Cannot get upload ID.\n");
+	free(path);
+	if(responselen < maglen || strncmp(response, UPLOAD_SEGMENTS_MAGIC, maglen) != 0) {
+		fprintf(stderr, "Not a s3ar segment manifest.\n");
+		free(response);
 		return 1;
 	}
 
-	fprintf(stderr, "Upload ID: %s\n", uploadId);
-	buffer = calloc(S3_PUT_BUFSIZ, sizeof(char));
+	/* Lines look like "<size> <sha256> <path>" */
+	for(line = response + maglen; (eol = strchr(line, '\n')) != NULL; line = eol + 1) {
+		*eol = '\0';
+		tmp = realloc(*segs, (*nsegs + 1) * sizeof(struct SegmentObject));
+		if(tmp == NULL) {
+			fprintf(stderr, "realloc() for segments failed.\n");
+			free(response);
+			return 1;
+		}
+
+		*segs = tmp;
+		tmp += *nsegs;
+		tmp->start = offset;
+		tmp->size = strtoull(line, &p, 10);
+		p = strchr(p + 1, ' ');
+		if(p == NULL || (tmp->path = strdup(p + 1)) == NULL) {
+			fprintf(stderr, "Malformed segment manifest line, giving up.\n");
+			free(response);
+			return 1;
+		}
+
+		offset += tmp->size;
+		(*nsegs)++;
+	}
+
+	free(response);
+	return 0;
+}
+
+static int fetch_range(struct Target *t, struct SegmentObject *segs, size_t nsegs, unsigned long long start, unsigned long long end) {
+	unsigned long long from;
+	unsigned long long to;
+	size_t i;
+
+	if(nsegs == 0)
+		return s3_getobject(t->endpoint, t->bucket, t->aws_path, t->aws_key, t->aws_secret, start, end - start, stdout, NULL, NULL);
 
-	if(buffer == NULL) {
-		fprintf(stderr, "Cannot allocate memory for buffer.\n");
-		exit(EXIT_FAILURE);
+	/* The range may span several segment objects */
+	for(i=0; i<nsegs && start < end; i++) {
+		if(start >= segs[i].start + segs[i].size)
+			continue;
+
+		from = start - segs[i].start;
+		to = end - segs[i].start < segs[i].size ? end - segs[i].start : segs[i].size;
+		if(s3_getobject(t->endpoint, t->bucket, segs[i].path, t->aws_key, t->aws_secret, from, to - from, stdout, NULL, NULL) != 0)
+			return 1;
+
+		start = segs[i].start + to;
 	}
 
-	while(!feof(stdin)) {
-                if((buflen = fread(buffer, sizeof(char), S3_PUT_BUFSIZ, stdin)) != 0) {
-#ifdef S3ARDEBUG
-                        fprintf(stderr, " -- s3ar: read %d bytes of stdin\n", buflen);
-#endif
-			partnum++;
-			ret = 1;
-			for(i=0; i <= S3_MAX_UPLOAD_RETRY; i++) {
-				if(i > 0) {
-					fprintf(stderr, "Warning: Upload of part %d has seemingly failed, retrying in 5 seconds... (%d of %d retries) \n", partnum, i, S3_MAX_UPLOAD_RETRY);
-					sleep(S3_UPLOAD_RETRY_WAIT);
+	return start < end;
+}
+
+static int range_cmp(const void *a, const void *b) {
+	const struct Range *ra = a;
+	const struct Range *rb = b;
+
+	return ra->start < rb->start ? -1 : ra->start > rb->start;
+}
+
+static int extract(struct Target *t, int nnames, char **names) {
+	char *idxpath;
+	char *response = NULL;
+	char *prefix;
+	size_t responselen = 0;
+	size_t first, count, i, len;
+	size_t nranges = 0;
+	size_t r;
+	int n;
+	short prefixmatch;
+	struct TarIndex ti;
+	struct TarMember *tm;
+	struct Range *ranges = NULL;
+	struct Range *tmp;
+	struct SegmentObject *segs = NULL;
+	size_t nsegs = 0;
+	short segmented;
+	char zeros[2*TAR_BLOCKSIZE];
+
+	len = strlen(t->aws_path) + strlen(TAR_INDEX_SUFFIX) + 1;
+	idxpath = malloc(len);
+	if(idxpath == NULL) {
+		fprintf(stderr, "malloc() for idxpath failed.\n");
+		return 1;
+	}
+
+	snprintf(idxpath, len, "%s%s", t->aws_path, TAR_INDEX_SUFFIX);
+	if(s3_getobject(t->endpoint, t->bucket, idxpath, t->aws_key, t->aws_secret, 0, 0, NULL, &response, &responselen) != 0 || response == NULL) {
+		fprintf(stderr, "Cannot fetch tar index %s.\n", idxpath);
+		free(idxpath);
+		return 1;
+	}
+
+	free(idxpath);
+	if(tar_index_parse(&ti, response, responselen) != 0) {
+		free(response);
+		return 1;
+	}
+
+	free(response);
+
+	for(n=0; n<nnames; n++) {
+		/* Match the member itself and, for directories, everything below it */
+		for(prefixmatch=0; prefixmatch<2; prefixmatch++) {
+			if(prefixmatch) {
+				len = strlen(names[n]);
+				prefix = malloc(len + 2);
+				if(prefix == NULL) {
+					fprintf(stderr, "malloc() for prefix failed.\n");
+					return 1;
 				}
-                        	
-				ret = s3_putpart(endpoint, bucket, argv[1], aws_key, aws_secret, uploadId, partnum, buffer, buflen, &responsehdr, &rhlen);
-				if(ret == 0)
-					break;
+
+				snprintf(prefix, len + 2, (len > 0 && names[n][len-1] == '/') ? "%s" : "%s/", names[n]);
+				first = tar_index_lookup(&ti, prefix, 1, &count);
+				free(prefix);
+			} else {
+				first = tar_index_lookup(&ti, names[n], 0, &count);
 			}
 
-			if(i >= 3) {
-				fprintf(stderr, "Failed upload of part %d three times, giving up.\n", partnum);
-				exit(EXIT_FAILURE);
+			tmp = realloc(ranges, (nranges + count) * sizeof(struct Range));
+			if(count > 0 && tmp == NULL) {
+				fprintf(stderr, "realloc() for ranges failed.\n");
+				return 1;
 			}
 
-			fprintf(stderr, "Part %5d: %s\n", partnum, responsehdr);
-			fflush(stdout);
-                        et = realloc(et, partnum * sizeof(struct ETag));
-
-                        if(et == NULL) {
-                                fprintf(stderr, "Failed to realloc() space for ETag");
-                                exit(1);
-                        }
-
-                        curr_et = et+partnum-1;
-                        curr_et->partnum = partnum;
-                        curr_et->buffer = responsehdr;
-                        curr_et->buflen = rhlen;
-			SHA256_Update(&sha256, buffer, buflen);
-			responsehdr = NULL;
-			rhlen = 0;
-			bufsum += buflen;
-                }
-        }
-
-	SHA256_Final(hash, &sha256);
-	free(buffer);
-
-        for(i=0; i<partnum; i++) {
-                curr_et = et+i;
-		if(curr_et->buffer == NULL) {
-                	fprintf(stderr, "Part %d has empty ETag\n", curr_et->partnum);
-			oktocomplete = 0;
+			ranges = tmp;
+			for(i=first; i<first+count; i++) {
+				tm = ti.members + i;
+				ranges[nranges].start = tm->start;
+				ranges[nranges].end = tm->offset + (tm->size + TAR_BLOCKSIZE - 1) / TAR_BLOCKSIZE * TAR_BLOCKSIZE;
+				nranges++;
+			}
 		}
-        }
-	
-	if(oktocomplete < 1) {
-			fprintf(stderr, " -- s3ar: Part with unset ETag found, will not complete.\n");
-			exit(EXIT_FAILURE);
 	}
 
-	s3_completepart(endpoint, bucket, argv[1], aws_key, aws_secret, uploadId, et, partnum);
-	fprintf(stderr, "\nTransferred %llu bytes\nSHA256: ", bufsum);
+	segmented = ti.segmented;
+	tar_index_free(&ti);
+
+	if(segmented && load_segments(t, &segs, &nsegs) != 0) {
+		free(ranges);
+		return 1;
+	}
+
+	if(nranges == 0) {
+		fprintf(stderr, "No matching members found in index.\n");
+		free(ranges);
+		return 1;
+	}
+
+	/* Fetch members in archive order and merge adjacent ones into a single request */
+	qsort(ranges, nranges, sizeof(struct Range), range_cmp);
+	for(i=0, r=0; i<nranges; i++) {
+		if(r > 0 && ranges[i].start <= ranges[r-1].end) {
+			if(ranges[i].end > ranges[r-1].end)
+				ranges[r-1].end = ranges[i].end;
+			continue;
+		}
+
+		ranges[r++] = ranges[i];
+	}
+
+	for(i=0; i<r; i++) {
+#ifdef S3ARDEBUG
+		fprintf(stderr, " -- s3ar: fetching bytes %llu-%llu\n", ranges[i].start, ranges[i].end);
+#endif
+		if(fetch_range(t, segs, nsegs, ranges[i].start, ranges[i].end) != 0) {
+			fprintf(stderr, "Failed to fetch bytes %llu-%llu of %s.\n", ranges[i].start, ranges[i].end, t->aws_path);
+			free(ranges);
+			return 1;
+		}
+	}
+
+	/* End of archive marker */
+	memset(zeros, 0, sizeof(zeros));
+	fwrite(zeros, sizeof(char), sizeof(zeros), stdout);
+	fflush(stdout);
+	fprintf(stderr, "Extracted %zu member(s) in %zu range(s)\n", nranges, r);
+	for(i=0; i<nsegs; i++)
+		free(segs[i].path);
+
+	free(segs);
+	free(ranges);
+	return 0;
+}
+
+static int input_is_stdin(char *input) {
+	char *end;
+	long fd;
+
+	if(strcmp(input, "-") == 0)
+		return 1;
+
+	fd = strtol(input, &end, 10);
+	return *end == '\0' && end != input && fd == STDIN_FILENO;
+}
+
+static int open_input(char *input) {
+	char *end;
+	long fd;
+	int ret;
+
+	if(input == NULL || strcmp(input, "-") == 0)
+		return STDIN_FILENO;
+
+	fd = strtol(input, &end, 10);
+	if(*end == '\0' && end != input && fd >= 0)
+		return (int)fd;
+
+	/* Opening a FIFO blocks until its writer shows up, which is why every stream does it in its own thread */
+	if((ret = open(input, O_RDONLY)) < 0)
+		fprintf(stderr, "Cannot open %s: %s\n", input, strerror(errno));
+
+	return ret;
+}
+
+static int stream_upload(struct Stream *st) {
+	struct S3ar *h;
+	char *buffer;
+	size_t buflen;
+	ssize_t len;
+	int fd;
+	int ret;
+
+	/* Nothing was uploaded to any target unless the handle opens */
+	st->result.failed = st->opts.ntargets;
+	if((fd = open_input(st->input)) < 0)
+		return 1;
+
+	if((h = s3ar_open(&st->opts)) == NULL) {
+		if(fd != STDIN_FILENO)
+			close(fd);
+		return 1;
+	}
+
+	/* Read straight into the part buffer, or the spool chunk when spooling */
+	while((buffer = s3ar_reserve(h, &buflen)) != NULL) {
+		len = read(fd, buffer, buflen);
+		if(len < 0) {
+			if(errno == EINTR)
+				continue;
+			fprintf(stderr, "Cannot read %s: %s\n", st->input != NULL ? st->input : "stdin", strerror(errno));
+			s3ar_abort(h);
+			break;
+		}
+
+#ifdef S3ARDEBUG
+		fprintf(stderr, " -- s3ar: read %zd bytes of %s\n", len, st->input != NULL ? st->input : "stdin");
+#endif
+		if(len == 0)
+			break;
+
+		if(s3ar_commit(h, len) != 0)
+			break;
+	}
+
+	ret = s3ar_close(h, &st->result);
+	if(fd != STDIN_FILENO)
+		close(fd);
+
+	return ret;
+}
+
+static void *stream_thread(void *arg) {
+	struct Stream *st = (struct Stream *)arg;
+
+	st->ret = stream_upload(st);
+	return NULL;
+}
+
+static void stream_summary(struct Stream *st, char **names, int nnames) {
+	unsigned int i;
+	int n;
+
+	if(st->input != NULL)
+		fprintf(stderr, "\n%s: Transferred %llu bytes\nSHA256: ", st->aws_path, st->result.bytes);
+	else
+		fprintf(stderr, "\nTransferred %llu bytes\nSHA256: ", st->result.bytes);
 
 	for(i = 0; i < SHA256_DIGEST_LENGTH; i++)
 	{
-		fprintf(stderr, "%02x", hash[i]);
+		fprintf(stderr, "%02x", st->result.sha256[i]);
 	}
 
 	fprintf(stderr, "\n");
-	free(et);
-	free(uploadId);
-	uploadId = NULL;
+
+	if(st->result.segments > 0)
+		fprintf(stderr, "Segments: %u\n", st->result.segments);
+
+	if(st->result.placement[0] != '\0')
+		fprintf(stderr, "Placement: %s\n", st->result.placement);
+
+	for(n=0; n<st->opts.ntargets && nnames > 0; n++)
+		fprintf(stderr, "Target %s: %s\n", names[n], st->targets[n].failed ? "FAILED" : "complete");
+}
+
+int main(int argc, char *argv[]) {
+	char *aws_path;
+	char *sep;
+	char *label;
+	size_t labellen;
+	int c;
+	int n;
+	int i;
+	int failed = 0;
+	short do_extract = 0;
+	struct S3arOptions opts;
+	struct S3arPool *pool = NULL;
+	unsigned int poolbuffers = 0;
+	unsigned int pooltransfers = 0;
+	struct Stream *streams;
+	int nstreams;
+	char **names = NULL;
+	int nnames = 0;
+	struct Target *targets;
+	int ntargets;
+
+	s3ar_options_init(&opts);
+
+	while((c = getopt(argc, argv, "A:b:c:il:r:R:s:S:T:x")) != -1) {
+		switch(c) {
+		case 'A':
+			if(strncmp(optarg, "read=", 5) == 0) {
+				opts.readcpus = optarg + 5;
+			} else if(strncmp(optarg, "upload=", 7) == 0) {
+				opts.uploadcpus = optarg + 7;
+			} else {
+				fprintf(stderr, "Invalid placement %s, expected read=cpus or upload=cpus\n", optarg);
+				return 1;
+			}
+			break;
+		case 'b':
+			poolbuffers = strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			pooltransfers = strtoul(optarg, NULL, 10);
+			break;
+		case 'i':
+			opts.index = 1;
+			break;
+		case 'l':
+			opts.slack = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			opts.rollsize = parse_size(optarg);
+			if(opts.rollsize == 0) {
+				fprintf(stderr, "Invalid rollover size %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'R':
+			opts.rolltime = strtoul(optarg, NULL, 10);
+			if(opts.rolltime == 0) {
+				fprintf(stderr, "Invalid rollover interval %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 's':
+			opts.spooldir = optarg;
+			break;
+		case 'S':
+			opts.spoolmax = parse_size(optarg);
+			if(opts.spoolmax == 0) {
+				fprintf(stderr, "Invalid spool size %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'T':
+			names = realloc(names, (nnames + 1) * sizeof(char *));
+			if(names == NULL) {
+				fprintf(stderr, "realloc() for target names failed.\n");
+				return 1;
+			}
+			names[nnames++] = optarg;
+			break;
+		case 'x':
+			do_extract = 1;
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if(optind >= argc) {
+		fprintf(stderr, "Missing aws_path (/foo.xyz)\n");
+		usage();
+		return(1);
+	}
+
+	aws_path = argv[optind++];
+
+	if(do_extract && optind >= argc) {
+		fprintf(stderr, "Missing member names to extract\n");
+		usage();
+		return 1;
+	}
+
+	ntargets = nnames > 0 ? nnames : 1;
+	targets = calloc(ntargets, sizeof(struct Target));
+	if(targets == NULL) {
+		fprintf(stderr, "calloc() for targets failed.\n");
+		return 1;
+	}
+
+	for(n=0; n<ntargets; n++) {
+		if(target_from_env(targets + n, nnames > 0 ? names[n] : NULL, aws_path) != 0)
+			exit(EXIT_FAILURE);
+	}
+
+	if(do_extract)
+		return extract(targets, argc - optind, argv + optind);
+
+	/* A single argument is always an aws_path uploaded from stdin, even if it contains ':', otherwise every argument names an input and its object */
+	nstreams = argc - optind + 1;
+	streams = calloc(nstreams, sizeof(struct Stream));
+	if(streams == NULL) {
+		fprintf(stderr, "calloc() for streams failed.\n");
+		return 1;
+	}
+
+	if(nstreams == 1) {
+		streams[0].aws_path = aws_path;
+	} else {
+		for(i=0; i<nstreams; i++) {
+			streams[i].input = argv[optind - 1 + i];
+			if((sep = strstr(streams[i].input, ":/")) == NULL || sep == streams[i].input) {
+				fprintf(stderr, "Invalid stream %s, expected input:/aws_path\n", streams[i].input);
+				return 1;
+			}
+
+			*sep = '\0';
+			streams[i].aws_path = sep + 1;
+
+			/* Two streams cannot share stdin, each would only see a random share of its blocks */
+			for(n=0; n<i; n++) {
+				if(input_is_stdin(streams[n].input) && input_is_stdin(streams[i].input)) {
+					fprintf(stderr, "Only one stream can read stdin, %s and %s both do\n", streams[n].aws_path, streams[i].aws_path);
+					return 1;
+				}
+			}
+		}
+	}
+
+	for(i=0; i<nstreams; i++) {
+		streams[i].opts = opts;
+		streams[i].opts.aws_path = streams[i].aws_path;
+		streams[i].opts.ntargets = ntargets;
+		streams[i].opts.targets = streams[i].targets = calloc(ntargets, sizeof(struct S3arTarget));
+		if(streams[i].targets == NULL) {
+			fprintf(stderr, "calloc() for targets failed.\n");
+			return 1;
+		}
+
+		for(n=0; n<ntargets; n++) {
+			streams[i].targets[n].name = targets[n].name;
+			streams[i].targets[n].endpoint = targets[n].endpoint;
+			streams[i].targets[n].bucket = targets[n].bucket;
+			streams[i].targets[n].key = targets[n].aws_key;
+			streams[i].targets[n].secret = targets[n].aws_secret;
+
+			if(nstreams > 1) {
+				/* Tell the streams apart in messages */
+				labellen = strlen(streams[i].aws_path) + (targets[n].name != NULL ? strlen(targets[n].name) + 1 : 0) + 1;
+				if((label = malloc(labellen)) == NULL) {
+					fprintf(stderr, "malloc() for target label failed.\n");
+					return 1;
+				}
+
+				snprintf(label, labellen, "%s%s%s", streams[i].aws_path, targets[n].name != NULL ? " " : "", targets[n].name != NULL ? targets[n].name : "");
+				streams[i].targets[n].name = label;
+			}
+		}
+	}
+
+	if(nstreams == 1) {
+		streams[0].ret = stream_upload(streams);
+		if(streams[0].ret != 0 && streams[0].result.failed == ntargets) {
+			fprintf(stderr, "Upload failed.\n");
+			exit(EXIT_FAILURE);
+		}
+
+		stream_summary(streams, names, nnames);
+		failed = streams[0].ret != 0;
+	} else {
+		if(poolbuffers == 0)
+			poolbuffers = nstreams + (nstreams + 1) / 2;
+		if(pooltransfers == 0)
+			pooltransfers = nstreams * ntargets;
+
+		if((pool = s3ar_pool_create(poolbuffers, pooltransfers)) == NULL)
+			return 1;
+
+		fprintf(stderr, "Uploading %d streams with %u shared buffers and at most %u parts in flight\n", nstreams, poolbuffers, pooltransfers);
+		for(i=0; i<nstreams; i++) {
+			streams[i].opts.pool = pool;
+			if(pthread_create(&streams[i].thread, NULL, stream_thread, streams + i) != 0) {
+				fprintf(stderr, "Cannot start stream thread.\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		for(i=0; i<nstreams; i++)
+			pthread_join(streams[i].thread, NULL);
+
+		for(i=0; i<nstreams; i++) {
+			if(streams[i].ret != 0 && streams[i].result.failed == ntargets) {
+				fprintf(stderr, "\n%s: Upload failed.\n", streams[i].aws_path);
+				failed++;
+				continue;
+			}
+
+			stream_summary(streams + i, names, nnames);
+			if(streams[i].ret != 0)
+				failed++;
+		}
+
+		s3ar_pool_destroy(pool);
+	}
+
+	for(i=0; i<nstreams; i++) {
+		for(n=0; n<ntargets && nstreams > 1; n++)
+			free(streams[i].targets[n].name);
+		free(streams[i].targets);
+	}
+
+	free(streams);
+	free(targets);
+	free(names);
+	return failed > 0 ? EXIT_FAILURE : 0;
 }
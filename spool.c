@@ -0,0 +1,253 @@
+/* Copyright (c) 2021 J. von Rotz <jr@vrtz.ch>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "spool.h"
+
+static void spool_partpath(struct Spool *sp, unsigned int partnum, char *path, size_t pathlen) {
+	snprintf(path, pathlen, "%s/part.%05u", sp->dir, partnum);
+}
+
+static int spool_publish(struct Spool *sp) {
+	if(close(sp->fd) != 0) {
+		fprintf(stderr, "Cannot close spool file: %s\n", strerror(errno));
+		return 1;
+	}
+
+	sp->fd = -1;
+	sp->writelen = 0;
+	pthread_mutex_lock(&sp->lock);
+	sp->written++;
+	pthread_cond_broadcast(&sp->cond);
+	pthread_mutex_unlock(&sp->lock);
+	return 0;
+}
+
+int spool_init(struct Spool *sp, char *basedir, unsigned long long maxbytes, size_t partsize) {
+	size_t len;
+
+	memset(sp, 0, sizeof(struct Spool));
+	sp->fd = -1;
+	sp->partsize = partsize;
+	sp->maxbytes = maxbytes;
+
+	if(maxbytes < partsize) {
+		fprintf(stderr, "Spool size must be at least one part (%zu bytes).\n", partsize);
+		return 1;
+	}
+
+	len = strlen(basedir) + strlen("/s3ar.XXXXXX") + 1;
+	sp->dir = malloc(len);
+	if(sp->dir == NULL) {
+		fprintf(stderr, "malloc() for spool directory failed.\n");
+		return 1;
+	}
+
+	snprintf(sp->dir, len, "%s/s3ar.XXXXXX", basedir);
+	if(mkdtemp(sp->dir) == NULL) {
+		fprintf(stderr, "Cannot create spool directory in %s: %s\n", basedir, strerror(errno));
+		free(sp->dir);
+		sp->dir = NULL;
+		return 1;
+	}
+
+	pthread_mutex_init(&sp->lock, NULL);
+	pthread_cond_init(&sp->cond, NULL);
+	return 0;
+}
+
+int spool_write(struct Spool *sp, const char *buffer, size_t buflen) {
+	char path[BUFSIZ];
+	size_t n;
+	ssize_t w;
+
+	while(buflen > 0) {
+		if(sp->fd < 0) {
+			spool_partpath(sp, sp->written + 1, path, sizeof(path));
+			sp->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+			if(sp->fd < 0) {
+				fprintf(stderr, "Cannot create spool file %s: %s\n", path, strerror(errno));
+				return 1;
+			}
+		}
+
+		n = sp->partsize - sp->writelen;
+		if(n > buflen)
+			n = buflen;
+
+		/* This is the only place the producer ever waits: when the disk cap is reached */
+		pthread_mutex_lock(&sp->lock);
+		while(!sp->aborted && sp->usedbytes + n > sp->maxbytes)
+			pthread_cond_wait(&sp->cond, &sp->lock);
+
+		if(sp->aborted) {
+			pthread_mutex_unlock(&sp->lock);
+			return 1;
+		}
+
+		sp->usedbytes += n;
+		pthread_mutex_unlock(&sp->lock);
+
+		while(n > 0) {
+			w = write(sp->fd, buffer, n);
+			if(w < 0) {
+				if(errno == EINTR)
+					continue;
+				fprintf(stderr, "Cannot write to spool: %s\n", strerror(errno));
+				return 1;
+			}
+
+			buffer += w;
+			buflen -= w;
+			n -= w;
+			sp->writelen += w;
+		}
+
+		if(sp->writelen == sp->partsize && spool_publish(sp) != 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+int spool_cut(struct Spool *sp) {
+	/* Hand out the part being written even though it is short */
+	if(sp->fd >= 0)
+		return spool_publish(sp);
+
+	return 0;
+}
+
+int spool_finish(struct Spool *sp) {
+	if(sp->fd >= 0 && spool_publish(sp) != 0)
+		return 1;
+
+	pthread_mutex_lock(&sp->lock);
+	sp->eof = 1;
+	pthread_cond_broadcast(&sp->cond);
+	pthread_mutex_unlock(&sp->lock);
+	return 0;
+}
+
+int spool_next(struct Spool *sp, char *buffer, size_t *buflen, unsigned int *partnum) {
+	char path[BUFSIZ];
+	int fd;
+	ssize_t r;
+	size_t len = 0;
+
+	pthread_mutex_lock(&sp->lock);
+	while(!sp->aborted && !sp->eof && sp->taken == sp->written)
+		pthread_cond_wait(&sp->cond, &sp->lock);
+
+	if(sp->aborted || sp->taken == sp->written) {
+		pthread_mutex_unlock(&sp->lock);
+		return 1;
+	}
+
+	*partnum = ++sp->taken;
+	pthread_mutex_unlock(&sp->lock);
+
+	spool_partpath(sp, *partnum, path, sizeof(path));
+	fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		fprintf(stderr, "Cannot open spool file %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	while(len < sp->partsize) {
+		r = read(fd, buffer + len, sp->partsize - len);
+		if(r < 0) {
+			if(errno == EINTR)
+				continue;
+			fprintf(stderr, "Cannot read spool file %s: %s\n", path, strerror(errno));
+			close(fd);
+			return -1;
+		}
+
+		if(r == 0)
+			break;
+
+		len += r;
+	}
+
+	close(fd);
+	*buflen = len;
+	return 0;
+}
+
+void spool_release(struct Spool *sp, unsigned int partnum, size_t buflen) {
+	char path[BUFSIZ];
+
+	spool_partpath(sp, partnum, path, sizeof(path));
+	if(unlink(path) != 0)
+		fprintf(stderr, "Warning: Cannot remove spool file %s: %s\n", path, strerror(errno));
+
+	pthread_mutex_lock(&sp->lock);
+	sp->usedbytes -= buflen;
+	pthread_cond_broadcast(&sp->cond);
+	pthread_mutex_unlock(&sp->lock);
+}
+
+void spool_abort(struct Spool *sp) {
+	pthread_mutex_lock(&sp->lock);
+	sp->aborted = 1;
+	pthread_cond_broadcast(&sp->cond);
+	pthread_mutex_unlock(&sp->lock);
+}
+
+void spool_destroy(struct Spool *sp) {
+	char path[BUFSIZ];
+	unsigned int i;
+
+	if(sp->dir == NULL)
+		return;
+
+	if(sp->fd >= 0)
+		close(sp->fd);
+
+	/* Remove whatever has not been acknowledged, e.g. after an abort */
+	for(i=1; i<=sp->written+1; i++) {
+		spool_partpath(sp, i, path, sizeof(path));
+		unlink(path);
+	}
+
+	if(rmdir(sp->dir) != 0)
+		fprintf(stderr, "Warning: Cannot remove spool directory %s: %s\n", sp->dir, strerror(errno));
+
+	pthread_mutex_destroy(&sp->lock);
+	pthread_cond_destroy(&sp->cond);
+	free(sp->dir);
+	sp->dir = NULL;
+}
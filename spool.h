@@ -0,0 +1,57 @@
+/* Copyright (c) 2021 J. von Rotz <jr@vrtz.ch>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+
+#define SPOOL_CHUNKSIZ 8388608 /* 8M per write to the spool */
+#define SPOOL_DEFAULT_MAX 4294967296ULL /* 4G of disk by default */
+
+struct Spool {
+	char *dir;
+	size_t partsize;
+	unsigned long long maxbytes;  /* Hard cap on disk usage */
+	unsigned long long usedbytes; /* Bytes on disk, including the part being written */
+	int fd;                       /* Part file currently being written, or -1 */
+	size_t writelen;
+	unsigned int written;         /* Parts completely written */
+	unsigned int taken;           /* Parts handed out to the uploader */
+	short eof;
+	short aborted;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+int spool_init(struct Spool *sp, char *basedir, unsigned long long maxbytes, size_t partsize);
+int spool_write(struct Spool *sp, const char *buffer, size_t buflen);
+int spool_cut(struct Spool *sp);
+int spool_finish(struct Spool *sp);
+int spool_next(struct Spool *sp, char *buffer, size_t *buflen, unsigned int *partnum);
+void spool_release(struct Spool *sp, unsigned int partnum, size_t buflen);
+void spool_abort(struct Spool *sp);
+void spool_destroy(struct Spool *sp);
@@ -0,0 +1,478 @@
+/* Copyright (c) 2021 J. von Rotz <jr@vrtz.ch>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tar.h"
+
+static unsigned long long tar_number(const char *field, size_t len) {
+	unsigned long long n = 0;
+	size_t i;
+
+	if((unsigned char)field[0] & 0x80) {
+		/* GNU base-256 encoding for values which do not fit into the octal field */
+		n = (unsigned char)field[0] & 0x7f;
+		for(i=1; i<len; i++)
+			n = (n << 8) | (unsigned char)field[i];
+		return n;
+	}
+
+	for(i=0; i<len && field[i] == ' '; i++);
+	for(; i<len && field[i] >= '0' && field[i] <= '7'; i++)
+		n = (n << 3) + (field[i] - '0');
+
+	return n;
+}
+
+static unsigned long long tar_padded(unsigned long long size) {
+	return (size + TAR_BLOCKSIZE - 1) / TAR_BLOCKSIZE * TAR_BLOCKSIZE;
+}
+
+static int tar_checksum_ok(const char *hdr) {
+	unsigned long long want = tar_number(hdr+148, 8);
+	unsigned long long usum = 0;
+	long long ssum = 0;
+	int i;
+	char c;
+
+	for(i=0; i<TAR_BLOCKSIZE; i++) {
+		c = (i >= 148 && i < 156) ? ' ' : hdr[i];
+		usum += (unsigned char)c;
+		ssum += (signed char)c;
+	}
+
+	/* Some historic implementations summed signed chars */
+	return want == usum || want == (unsigned long long)ssum;
+}
+
+static int tar_zero_block(const char *hdr) {
+	int i;
+
+	for(i=0; i<TAR_BLOCKSIZE; i++) {
+		if(hdr[i] != '\0')
+			return 0;
+	}
+
+	return 1;
+}
+
+static void tar_reset_pending(struct TarIndex *ti) {
+	free(ti->pending_path);
+	ti->pending_path = NULL;
+	ti->has_pending_size = 0;
+	ti->pending_size = 0;
+	ti->start = -1ULL;
+}
+
+static int tar_add_member(struct TarIndex *ti, char *path, unsigned long long start, unsigned long long offset, unsigned long long size) {
+	struct TarMember *tmp;
+	struct TarMember *tm;
+
+	if(ti->nmembers == ti->allocated) {
+		ti->allocated = ti->allocated ? ti->allocated * 2 : 1024;
+		tmp = realloc(ti->members, ti->allocated * sizeof(struct TarMember));
+		if(tmp == NULL) {
+			fprintf(stderr, "realloc() for tar index failed.\n");
+			return 1;
+		}
+
+		ti->members = tmp;
+	}
+
+	tm = ti->members + ti->nmembers++;
+	tm->path = path;
+	tm->start = start;
+	tm->offset = offset;
+	tm->size = size;
+	return 0;
+}
+
+static void tar_parse_pax(struct TarIndex *ti) {
+	char *rec = ti->meta;
+	char *end = ti->meta + ti->metalen;
+	char *kw;
+	char *eq;
+	char *nl;
+	unsigned long long reclen;
+
+	/* Records look like "<length> <keyword>=<value>\n" */
+	while(rec < end) {
+		reclen = strtoull(rec, &kw, 10);
+		if(reclen == 0 || kw == rec || *kw != ' ' || reclen > (unsigned long long)(end - rec))
+			break;
+
+		/* The length prefix counts itself, a record shorter than that is corrupt */
+		kw++;
+		nl = rec + reclen - 1;
+		if(kw >= nl)
+			break;
+
+		eq = memchr(kw, '=', nl - kw);
+		if(eq != NULL && *nl == '\n') {
+			if(eq - kw == 4 && strncmp(kw, "path", 4) == 0) {
+				free(ti->pending_path);
+				ti->pending_path = strndup(eq+1, nl - (eq+1));
+			} else if(eq - kw == 4 && strncmp(kw, "size", 4) == 0) {
+				ti->pending_size = strtoull(eq+1, NULL, 10);
+				ti->has_pending_size = 1;
+			}
+		}
+
+		rec += reclen;
+	}
+}
+
+static void tar_finish_meta(struct TarIndex *ti) {
+	if(ti->metawant > TAR_MAX_META) {
+		fprintf(stderr, "Warning: tar extended header at offset %llu too large, ignoring it.\n", ti->start);
+	} else if(ti->meta_type == 'x') {
+		/* Numbers are parsed with strtoull(), which must not run past the payload */
+		ti->meta[ti->metalen] = '\0';
+		tar_parse_pax(ti);
+	} else if(ti->meta_type == 'L') {
+		free(ti->pending_path);
+		ti->pending_path = strndup(ti->meta, ti->metalen);
+	}
+
+	free(ti->meta);
+	ti->meta = NULL;
+	ti->meta_type = 0;
+	ti->metalen = ti->metawant = 0;
+}
+
+static int tar_header(struct TarIndex *ti, const char *hdr) {
+	unsigned long long hdrpos = ti->pos - TAR_BLOCKSIZE;
+	unsigned long long size;
+	char type;
+	char *path;
+	size_t alloc;
+
+	if(tar_zero_block(hdr)) {
+		if(++ti->zeroblocks >= 2)
+			ti->state = TAR_END;
+		return 0;
+	}
+
+	ti->zeroblocks = 0;
+
+	if(!tar_checksum_ok(hdr)) {
+		fprintf(stderr, "Warning: Input does not look like a tar stream at offset %llu, not indexing.\n", hdrpos);
+		ti->state = TAR_INVALID;
+		return 0;
+	}
+
+	size = tar_number(hdr+124, 12);
+	type = hdr[156];
+
+	if(ti->start == -1ULL)
+		ti->start = hdrpos;
+
+	switch(type) {
+	case 'x':
+	case 'L':
+		/* Payload describes the next member, keep it */
+		alloc = size < TAR_MAX_META ? size : TAR_MAX_META;
+		ti->meta = malloc(alloc + 1);
+		if(ti->meta == NULL) {
+			fprintf(stderr, "malloc() for tar extended header failed.\n");
+			return 1;
+		}
+
+		ti->meta_type = type;
+		ti->metawant = size;
+		ti->metalen = 0;
+		ti->skip = tar_padded(size);
+		if(ti->skip == 0)
+			tar_finish_meta(ti);
+		else
+			ti->state = TAR_DATA;
+		return 0;
+	case 'g':
+		/* Global header, does not belong to any single member */
+		if(ti->start == hdrpos)
+			ti->start = -1ULL;
+		/* fall through */
+	case 'K':
+		ti->skip = tar_padded(size);
+		if(ti->skip > 0)
+			ti->state = TAR_DATA;
+		return 0;
+	case 'S':
+		if(hdr[482] != '\0') {
+			fprintf(stderr, "Warning: Old GNU sparse member at offset %llu, not indexing.\n", hdrpos);
+			ti->state = TAR_INVALID;
+			return 0;
+		}
+		break;
+	case '1':
+	case '2':
+	case '3':
+	case '4':
+	case '5':
+	case '6':
+		/* Links, devices, directories and FIFOs carry no data */
+		size = 0;
+		ti->has_pending_size = 0;
+		break;
+	}
+
+	if(ti->has_pending_size)
+		size = ti->pending_size;
+
+	if(ti->pending_path != NULL) {
+		path = ti->pending_path;
+		ti->pending_path = NULL;
+	} else if(memcmp(hdr+257, "ustar\0" "00", 8) == 0 && hdr[345] != '\0') {
+		/* Only POSIX ustar has a prefix here, GNU's "ustar  " keeps atime and ctime in this spot */
+		path = malloc(155 + 1 + 100 + 1);
+		if(path != NULL)
+			snprintf(path, 155 + 1 + 100 + 1, "%.155s/%.100s", hdr+345, hdr);
+	} else {
+		path = strndup(hdr, 100);
+	}
+
+	if(path == NULL) {
+		fprintf(stderr, "malloc() for tar member path failed.\n");
+		return 1;
+	}
+
+	if(tar_add_member(ti, path, ti->start, ti->pos, size) != 0) {
+		free(path);
+		return 1;
+	}
+
+	tar_reset_pending(ti);
+	ti->skip = tar_padded(size);
+	if(ti->skip > 0)
+		ti->state = TAR_DATA;
+
+	return 0;
+}
+
+void tar_index_init(struct TarIndex *ti) {
+	memset(ti, 0, sizeof(struct TarIndex));
+	ti->state = TAR_HEADER;
+	ti->start = -1ULL;
+}
+
+int tar_index_update(struct TarIndex *ti, const char *buffer, size_t buflen) {
+	size_t off = 0;
+	size_t n;
+	size_t m;
+	const char *hdr;
+
+	while(off < buflen && (ti->state == TAR_HEADER || ti->state == TAR_DATA)) {
+		if(ti->state == TAR_DATA) {
+			n = buflen - off;
+			if(n > ti->skip)
+				n = ti->skip;
+
+			if(ti->meta != NULL && ti->metalen < ti->metawant) {
+				m = ti->metawant - ti->metalen;
+				if(m > n)
+					m = n;
+				if(ti->metalen + m <= TAR_MAX_META)
+					memcpy(ti->meta + ti->metalen, buffer + off, m);
+				ti->metalen += m;
+			}
+
+			off += n;
+			ti->pos += n;
+			ti->skip -= n;
+
+			if(ti->skip == 0) {
+				ti->state = TAR_HEADER;
+				if(ti->meta != NULL)
+					tar_finish_meta(ti);
+			}
+
+			continue;
+		}
+
+		/* Parse header blocks in place, only copy the rare one split across two buffers */
+		if(ti->hdrlen == 0 && buflen - off >= TAR_BLOCKSIZE) {
+			hdr = buffer + off;
+			off += TAR_BLOCKSIZE;
+			ti->pos += TAR_BLOCKSIZE;
+		} else {
+			n = TAR_BLOCKSIZE - ti->hdrlen;
+			if(n > buflen - off)
+				n = buflen - off;
+
+			memcpy(ti->hdr + ti->hdrlen, buffer + off, n);
+			ti->hdrlen += n;
+			off += n;
+			ti->pos += n;
+
+			if(ti->hdrlen < TAR_BLOCKSIZE)
+				continue;
+
+			hdr = ti->hdr;
+			ti->hdrlen = 0;
+		}
+
+		if(tar_header(ti, hdr) != 0)
+			return 1;
+	}
+
+	ti->pos += buflen - off;
+	return 0;
+}
+
+static int tar_member_cmp(const void *a, const void *b) {
+	const struct TarMember *ma = a;
+	const struct TarMember *mb = b;
+	int c = strcmp(ma->path, mb->path);
+
+	if(c != 0)
+		return c;
+
+	return ma->start < mb->start ? -1 : ma->start > mb->start;
+}
+
+int tar_index_serialize(struct TarIndex *ti, char **out, size_t *outlen) {
+	size_t i;
+	size_t len;
+	size_t pos;
+	char *buffer;
+
+	qsort(ti->members, ti->nmembers, sizeof(struct TarMember), tar_member_cmp);
+
+	len = strlen(TAR_INDEX_MAGIC) + 1;
+	for(i=0; i<ti->nmembers; i++)
+		len += strlen(ti->members[i].path) + 3 * 21 + 1;
+
+	len += strlen(TAR_INDEX_SEGMENTED);
+	buffer = malloc(len);
+	if(buffer == NULL) {
+		fprintf(stderr, "malloc() for tar index failed.\n");
+		return 1;
+	}
+
+	pos = snprintf(buffer, len, "%s%s", TAR_INDEX_MAGIC, ti->segmented ? TAR_INDEX_SEGMENTED : "");
+	for(i=0; i<ti->nmembers; i++) {
+		if(strchr(ti->members[i].path, '\n') != NULL) {
+			fprintf(stderr, "Warning: Not indexing member with newline in its name at offset %llu.\n", ti->members[i].start);
+			continue;
+		}
+
+		pos += snprintf(buffer + pos, len - pos, "%llu %llu %llu %s\n", ti->members[i].start, ti->members[i].offset, ti->members[i].size, ti->members[i].path);
+	}
+
+	*out = buffer;
+	*outlen = pos;
+	return 0;
+}
+
+int tar_index_parse(struct TarIndex *ti, char *buffer, size_t buflen) {
+	char *line = buffer;
+	char *end = buffer + buflen;
+	char *eol;
+	char *p;
+	char *path;
+	unsigned long long start, offset, size;
+	size_t maglen = strlen(TAR_INDEX_MAGIC);
+
+	tar_index_init(ti);
+
+	if(buflen < maglen || strncmp(buffer, TAR_INDEX_MAGIC, maglen) != 0) {
+		fprintf(stderr, "Not a s3ar tar index.\n");
+		return 1;
+	}
+
+	line += maglen;
+	if(end - line >= strlen(TAR_INDEX_SEGMENTED) && strncmp(line, TAR_INDEX_SEGMENTED, strlen(TAR_INDEX_SEGMENTED)) == 0) {
+		ti->segmented = 1;
+		line += strlen(TAR_INDEX_SEGMENTED);
+	}
+
+	for(; line < end; line = eol + 1) {
+		eol = memchr(line, '\n', end - line);
+		if(eol == NULL)
+			break;
+
+		start = strtoull(line, &p, 10);
+		offset = strtoull(p, &p, 10);
+		size = strtoull(p, &p, 10);
+		if(*p != ' ' || p >= eol) {
+			fprintf(stderr, "Malformed tar index line, giving up.\n");
+			tar_index_free(ti);
+			return 1;
+		}
+
+		path = strndup(p+1, eol - (p+1));
+		if(path == NULL || tar_add_member(ti, path, start, offset, size) != 0) {
+			free(path);
+			tar_index_free(ti);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+size_t tar_index_lookup(struct TarIndex *ti, const char *path, short prefix, size_t *count) {
+	size_t lo = 0;
+	size_t hi = ti->nmembers;
+	size_t mid;
+	size_t i;
+	size_t len = strlen(path);
+
+	while(lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if(strcmp(ti->members[mid].path, path) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for(i=lo; i<ti->nmembers; i++) {
+		if(prefix ? strncmp(ti->members[i].path, path, len) != 0 : strcmp(ti->members[i].path, path) != 0)
+			break;
+	}
+
+	*count = i - lo;
+	return lo;
+}
+
+void tar_index_free(struct TarIndex *ti) {
+	size_t i;
+
+	for(i=0; i<ti->nmembers; i++)
+		free(ti->members[i].path);
+
+	free(ti->members);
+	free(ti->meta);
+	free(ti->pending_path);
+	ti->members = NULL;
+	ti->meta = NULL;
+	ti->pending_path = NULL;
+	ti->nmembers = ti->allocated = 0;
+}
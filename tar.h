@@ -0,0 +1,76 @@
+/* Copyright (c) 2021 J. von Rotz <jr@vrtz.ch>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define TAR_BLOCKSIZE 512
+#define TAR_MAX_META 1048576 /* Upper limit for pax/GNU long name payloads we keep */
+#define TAR_INDEX_SUFFIX ".idx"
+#define TAR_INDEX_MAGIC "s3ar-tarindex 1\n"
+#define TAR_INDEX_SEGMENTED "segmented\n" /* Offsets span the segments listed in the manifest */
+
+enum TarState {
+	TAR_HEADER,
+	TAR_DATA,
+	TAR_END,
+	TAR_INVALID
+};
+
+struct TarMember {
+	char *path;
+	unsigned long long start;  /* Offset of the first header block belonging to this member */
+	unsigned long long offset; /* Offset of the member data */
+	unsigned long long size;
+};
+
+struct TarIndex {
+	struct TarMember *members;
+	size_t nmembers;
+	size_t allocated;
+	enum TarState state;
+	unsigned long long pos;    /* Bytes of the stream seen so far */
+	unsigned long long skip;   /* Bytes of member data and padding left before the next header */
+	unsigned long long start;  /* Start of the member currently being assembled, or -1 */
+	char hdr[TAR_BLOCKSIZE];   /* Header block straddling two buffers */
+	size_t hdrlen;
+	char meta_type;            /* Typeflag of the pax/GNU header whose payload we collect */
+	char *meta;
+	size_t metalen;
+	size_t metawant;
+	char *pending_path;        /* Path from a preceding pax or GNU long name header */
+	unsigned long long pending_size;
+	short has_pending_size;
+	short zeroblocks;
+	short segmented;
+};
+
+void tar_index_init(struct TarIndex *ti);
+int tar_index_update(struct TarIndex *ti, const char *buffer, size_t buflen);
+int tar_index_serialize(struct TarIndex *ti, char **out, size_t *outlen);
+int tar_index_parse(struct TarIndex *ti, char *buffer, size_t buflen);
+size_t tar_index_lookup(struct TarIndex *ti, const char *path, short prefix, size_t *count);
+void tar_index_free(struct TarIndex *ti);
@@ -0,0 +1,683 @@
+/* Copyright (c) 2021 J. von Rotz <jr@vrtz.ch>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "s3.h"
+#include "spool.h"
+#include "upload.h"
+
+static const char *target_label(struct Target *t, char *label, size_t labellen) {
+	if(t->name == NULL)
+		return "";
+
+	snprintf(label, labellen, "[%s] ", t->name);
+	return label;
+}
+
+static void target_free_etags(struct Target *t) {
+	unsigned int i;
+
+	/* Parts of a segment which was never completed still hold their ETags */
+	for(i=0; t->et != NULL && i<t->segparts; i++)
+		free(t->et[i].buffer);
+
+	free(t->et);
+	t->et = NULL;
+}
+
+static char *segment_path(char *aws_path, unsigned int segment) {
+	size_t len = strlen(aws_path) + 16;
+	char *path = malloc(len);
+
+	if(path == NULL) {
+		fprintf(stderr, "malloc() for segment path failed.\n");
+		return NULL;
+	}
+
+	snprintf(path, len, "%s.%03u", aws_path, segment);
+	return path;
+}
+
+static int target_initpart(struct Target *t, char *path, char **uploadId) {
+	size_t uploadIdLen = 0;
+	char label[128];
+
+	*uploadId = NULL;
+	s3_initpart(t->endpoint, t->bucket, path, t->aws_key, t->aws_secret, uploadId, &uploadIdLen);
+
+	if(uploadIdLen < 1 || *uploadId == NULL) {
+		fprintf(stderr, "%sCannot get upload ID for %s.\n", target_label(t, label, sizeof(label)), path);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void target_fail(struct Target *t) {
+	struct Upload *up = t->up;
+	char label[128];
+
+	fprintf(stderr, "%sDropping this target.\n", target_label(t, label, sizeof(label)));
+	t->failed = 1;
+	pthread_mutex_lock(&up->lock);
+	up->alive--;
+	pthread_cond_broadcast(&up->cond);
+	pthread_mutex_unlock(&up->lock);
+}
+
+static int target_put(struct Target *t, struct Part *part) {
+	char *responsehdr = NULL;
+	size_t rhlen = 0;
+	char label[128];
+	struct ETag *curr_et;
+	struct ETag *tmp;
+	unsigned int i;
+	int ret = 1;
+
+	for(i=0; i <= S3_MAX_UPLOAD_RETRY; i++) {
+		if(i > 0) {
+			fprintf(stderr, "%sWarning: Upload of part %d has seemingly failed, retrying in %d seconds... (%d of %d retries) \n", target_label(t, label, sizeof(label)), part->segpart, S3_UPLOAD_RETRY_WAIT, i, S3_MAX_UPLOAD_RETRY);
+			sleep(S3_UPLOAD_RETRY_WAIT);
+		}
+
+		if(t->up->pool != NULL)
+			pool_begin(t->up->pool, &t->up->ps);
+		ret = s3_putpart(t->endpoint, t->bucket, t->path, t->aws_key, t->aws_secret, t->uploadId, part->segpart, part->data, part->buflen, &responsehdr, &rhlen);
+		if(t->up->pool != NULL)
+			pool_end(t->up->pool, &t->up->ps);
+		if(ret == 0)
+			break;
+	}
+
+	if(ret != 0) {
+		fprintf(stderr, "%sFailed upload of part %d %d times, giving up.\n", target_label(t, label, sizeof(label)), part->segpart, S3_MAX_UPLOAD_RETRY + 1);
+		return 1;
+	}
+
+	fprintf(stderr, "%sPart %5d: %s\n", target_label(t, label, sizeof(label)), part->segpart, responsehdr);
+	tmp = realloc(t->et, part->segpart * sizeof(struct ETag));
+
+	if(tmp == NULL) {
+		fprintf(stderr, "Failed to realloc() space for ETag\n");
+		free(responsehdr);
+		return 1;
+	}
+
+	t->et = tmp;
+	curr_et = t->et+part->segpart-1;
+	curr_et->partnum = part->segpart;
+	curr_et->buffer = responsehdr;
+	curr_et->buflen = rhlen;
+	t->segparts = part->segpart;
+	return 0;
+}
+
+static int target_complete(struct Target *t) {
+	char label[128];
+	unsigned int i;
+	short oktocomplete = 1;
+
+	if(t->segparts == 0) {
+		/* S3 refuses to complete an upload without parts, so store an empty object instead */
+		s3_abortpart(t->endpoint, t->bucket, t->path, t->aws_key, t->aws_secret, t->uploadId);
+		free(t->uploadId);
+		t->uploadId = NULL;
+		if(s3_putobject(t->endpoint, t->bucket, t->path, t->aws_key, t->aws_secret, "application/octet-stream", "", 0) != 0) {
+			fprintf(stderr, "%sCannot store empty object %s\n", target_label(t, label, sizeof(label)), t->path);
+			return 1;
+		}
+
+		return 0;
+	}
+
+	for(i=0; i<t->segparts; i++) {
+		if(t->et[i].buffer == NULL) {
+			fprintf(stderr, "%sPart %d has empty ETag\n", target_label(t, label, sizeof(label)), t->et[i].partnum);
+			oktocomplete = 0;
+		}
+	}
+
+	if(oktocomplete < 1) {
+		fprintf(stderr, " -- s3ar: %sPart with unset ETag found, will not complete.\n", target_label(t, label, sizeof(label)));
+		return 1;
+	}
+
+	if(s3_completepart(t->endpoint, t->bucket, t->path, t->aws_key, t->aws_secret, t->uploadId, t->et, t->segparts) != 0)
+		return 1;
+
+	if(t->up->rollover)
+		fprintf(stderr, "%sCompleted %s\n", target_label(t, label, sizeof(label)), t->path);
+
+	return 0;
+}
+
+static int target_manifest(struct Target *t) {
+	struct Upload *up = t->up;
+	struct Segment *seg;
+	char *buffer;
+	char *path;
+	char hex[2*SHA256_DIGEST_LENGTH+1];
+	size_t len;
+	size_t pos;
+	unsigned int i;
+	int j;
+	int ret;
+
+	/* Lists every segment this target has completed so far, so restores work while the stream goes on */
+	pthread_mutex_lock(&up->lock);
+	len = strlen(UPLOAD_SEGMENTS_MAGIC) + (t->segment + 1) * (strlen(t->aws_path) + 16 + 21 + sizeof(hex) + 2) + 1;
+	buffer = malloc(len);
+	if(buffer == NULL) {
+		pthread_mutex_unlock(&up->lock);
+		fprintf(stderr, "malloc() for segment manifest failed.\n");
+		return 1;
+	}
+
+	pos = snprintf(buffer, len, "%s", UPLOAD_SEGMENTS_MAGIC);
+	for(i=0; i<=t->segment && i<up->nsegments; i++) {
+		seg = up->segments + i;
+		for(j=0; j<SHA256_DIGEST_LENGTH; j++)
+			snprintf(hex + 2*j, 3, "%02x", seg->hash[j]);
+
+		pos += snprintf(buffer + pos, len - pos, "%llu %s %s.%03u\n", seg->size, hex, t->aws_path, i);
+	}
+	pthread_mutex_unlock(&up->lock);
+
+	len = strlen(t->aws_path) + strlen(UPLOAD_SEGMENTS_SUFFIX) + 1;
+	path = malloc(len);
+	if(path == NULL) {
+		fprintf(stderr, "malloc() for manifest path failed.\n");
+		free(buffer);
+		return 1;
+	}
+
+	snprintf(path, len, "%s%s", t->aws_path, UPLOAD_SEGMENTS_SUFFIX);
+	ret = s3_putobject(t->endpoint, t->bucket, path, t->aws_key, t->aws_secret, "text/plain", buffer, pos);
+	free(path);
+	free(buffer);
+	return ret;
+}
+
+static void target_prefetch(struct Target *t) {
+	char *path;
+
+	/* Initiate the next segment right away, so crossing the boundary does not wait for it */
+	path = segment_path(t->aws_path, t->segment + 1);
+	if(path == NULL || target_initpart(t, path, &t->nextUploadId) != 0)
+		t->nextUploadId = NULL;
+
+	free(path);
+}
+
+static int target_advance(struct Target *t, unsigned int segment) {
+	if(target_complete(t) != 0 || target_manifest(t) != 0)
+		return 1;
+
+	free(t->uploadId);
+	target_free_etags(t);
+	free(t->path);
+	t->uploadId = t->nextUploadId;
+	t->nextUploadId = NULL;
+	t->segparts = 0;
+	t->segment = segment;
+	t->path = segment_path(t->aws_path, segment);
+
+	if(t->path == NULL)
+		return 1;
+
+	if(t->uploadId == NULL && target_initpart(t, t->path, &t->uploadId) != 0)
+		return 1;
+
+	target_prefetch(t);
+	return 0;
+}
+
+static void *target_thread(void *arg) {
+	struct Target *t = (struct Target *)arg;
+	struct Upload *up = t->up;
+	struct Part *part;
+	char label[128];
+	unsigned int partnum;
+	size_t buflen;
+	void (*release)(void *, void *);
+	void *data;
+	void *releasearg;
+	char *poolbuf;
+	int refs;
+
+	if(up->uploadcpus != NULL)
+		affinity_apply(up->uploadcpus);
+
+	if(up->rollover && !t->failed)
+		target_prefetch(t);
+
+	for(;;) {
+		pthread_mutex_lock(&up->lock);
+		while(!up->eof && up->published == t->partnum)
+			pthread_cond_wait(&up->cond, &up->lock);
+
+		if(up->published == t->partnum) {
+			pthread_mutex_unlock(&up->lock);
+			break;
+		}
+
+		part = up->parts + t->partnum % up->nparts;
+		pthread_mutex_unlock(&up->lock);
+
+		/* A failed target keeps acknowledging parts so it does not hold back the others */
+		if(!t->failed && !up->aborted) {
+			if(part->segment != t->segment && target_advance(t, part->segment) != 0)
+				target_fail(t);
+			else if(target_put(t, part) != 0)
+				target_fail(t);
+		}
+
+		partnum = part->partnum;
+		buflen = part->buflen;
+		data = part->data;
+		release = part->release;
+		releasearg = part->arg;
+		pthread_mutex_lock(&up->lock);
+		t->partnum = partnum;
+		affinity_note(&up->uploadran);
+		refs = --part->refs;
+		poolbuf = NULL;
+		if(refs == 0 && up->pool != NULL) {
+			/* Hand the buffer back before the producer can see the slot as free */
+			poolbuf = part->buffer;
+			part->buffer = NULL;
+		}
+		pthread_cond_broadcast(&up->cond);
+		pthread_mutex_unlock(&up->lock);
+
+		if(poolbuf != NULL)
+			pool_put(up->pool, &up->ps, poolbuf);
+
+		if(refs == 0 && up->spool != NULL)
+			spool_release(up->spool, partnum, buflen);
+
+		if(refs == 0 && release != NULL)
+			release(data, releasearg);
+	}
+
+	if(up->aborted)
+		t->failed = 1;
+
+	if(!t->failed && (target_complete(t) != 0 || (up->rollover && target_manifest(t) != 0)))
+		t->failed = 1;
+
+	if(t->failed && t->uploadId != NULL) {
+		fprintf(stderr, "%sAborting upload %s\n", target_label(t, label, sizeof(label)), t->uploadId);
+		s3_abortpart(t->endpoint, t->bucket, t->path, t->aws_key, t->aws_secret, t->uploadId);
+	}
+
+	if(t->nextUploadId != NULL) {
+		free(t->path);
+		t->path = segment_path(t->aws_path, t->segment + 1);
+		if(t->path != NULL)
+			s3_abortpart(t->endpoint, t->bucket, t->path, t->aws_key, t->aws_secret, t->nextUploadId);
+	}
+
+	return NULL;
+}
+
+int upload_init(struct Upload *up, struct Target *targets, int ntargets, unsigned int slack, size_t partsize, struct Spool *spool, struct Pool *pool) {
+	unsigned int i;
+	int n;
+
+	memset(up, 0, sizeof(struct Upload));
+	pthread_mutex_init(&up->lock, NULL);
+	pthread_cond_init(&up->cond, NULL);
+	SHA256_Init(&up->sha256);
+	up->targets = targets;
+	up->ntargets = ntargets;
+	up->alive = ntargets;
+	up->partsize = partsize;
+	up->spool = spool;
+	up->pool = pool;
+	up->nparts = slack + 1;
+	up->parts = calloc(up->nparts, sizeof(struct Part));
+
+	if(up->parts == NULL) {
+		fprintf(stderr, "calloc() for parts failed.\n");
+		return 1;
+	}
+
+	/* With a pool, slots only hold a buffer while a part is being filled or uploaded */
+	for(i=0; i<up->nparts && pool == NULL; i++) {
+		up->parts[i].buffer = malloc(partsize);
+		if(up->parts[i].buffer == NULL) {
+			fprintf(stderr, "Cannot allocate memory for buffer.\n");
+			upload_destroy(up);
+			return 1;
+		}
+	}
+
+	for(n=0; n<ntargets; n++)
+		targets[n].up = up;
+
+	return 0;
+}
+
+void upload_set_rollover(struct Upload *up, unsigned long long rollsize, unsigned int rolltime) {
+	up->rollover = 1;
+	up->rollsize = rollsize;
+	up->rolltime = rolltime;
+}
+
+static void upload_stop(struct Upload *up, int started) {
+	struct Target *t;
+	int i;
+
+	/* Threads already running abort their uploads on the way out, the others are aborted here */
+	pthread_mutex_lock(&up->lock);
+	up->aborted = 1;
+	up->eof = 1;
+	pthread_cond_broadcast(&up->cond);
+	pthread_mutex_unlock(&up->lock);
+
+	for(i=0; i<started; i++)
+		pthread_join(up->targets[i].thread, NULL);
+
+	for(i=started; i<up->ntargets; i++) {
+		t = up->targets + i;
+		if(t->uploadId != NULL)
+			s3_abortpart(t->endpoint, t->bucket, t->path, t->aws_key, t->aws_secret, t->uploadId);
+		t->failed = 1;
+	}
+}
+
+int upload_start(struct Upload *up) {
+	struct Target *t;
+	char label[128];
+	int i;
+
+	for(i=0; i<up->ntargets; i++) {
+		t = up->targets + i;
+		t->path = up->rollover ? segment_path(t->aws_path, 0) : strdup(t->aws_path);
+
+		if(t->path == NULL || target_initpart(t, t->path, &t->uploadId) != 0) {
+			t->failed = 1;
+			up->alive--;
+			continue;
+		}
+
+		fprintf(stderr, "%sUpload ID: %s\n", target_label(t, label, sizeof(label)), t->uploadId);
+	}
+
+	if(up->alive < 1)
+		return 1;
+
+	for(i=0; i<up->ntargets; i++) {
+		if(pthread_create(&up->targets[i].thread, NULL, target_thread, up->targets + i) != 0) {
+			fprintf(stderr, "Cannot start uploader thread.\n");
+			upload_stop(up, i);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int upload_slot(struct Upload *up) {
+	struct Part *part;
+	int ret;
+
+	/* Wait until every target is done with the part which used this slot before */
+	pthread_mutex_lock(&up->lock);
+	part = up->parts + up->published % up->nparts;
+	while(up->alive > 0 && part->refs > 0)
+		pthread_cond_wait(&up->cond, &up->lock);
+	ret = up->alive > 0 ? 0 : 1;
+	pthread_mutex_unlock(&up->lock);
+
+	return ret;
+}
+
+char *upload_buffer(struct Upload *up) {
+	struct Part *part = up->parts + up->published % up->nparts;
+
+	if(upload_slot(up) != 0)
+		return NULL;
+
+	if(up->pool != NULL && part->buffer == NULL)
+		part->buffer = pool_get(up->pool, &up->ps);
+
+	return part->buffer;
+}
+
+static int segment_start(struct Upload *up) {
+	struct Segment *seg;
+	struct Segment *tmp;
+
+	pthread_mutex_lock(&up->lock);
+	if(up->nsegments > 0) {
+		seg = up->segments + up->nsegments - 1;
+		if(up->rollover)
+			SHA256_Final(seg->hash, &up->segsha256);
+		seg->closed = 1;
+	}
+
+	if(up->nsegments == up->allocsegments) {
+		up->allocsegments = up->allocsegments ? up->allocsegments * 2 : 16;
+		tmp = realloc(up->segments, up->allocsegments * sizeof(struct Segment));
+		if(tmp == NULL) {
+			pthread_mutex_unlock(&up->lock);
+			fprintf(stderr, "realloc() for segments failed.\n");
+			return 1;
+		}
+
+		up->segments = tmp;
+	}
+
+	seg = up->segments + up->nsegments++;
+	memset(seg, 0, sizeof(struct Segment));
+	seg->firstpart = up->partsstarted + 1;
+	pthread_mutex_unlock(&up->lock);
+
+	if(up->rollover)
+		SHA256_Init(&up->segsha256);
+
+	up->segstart = time(NULL);
+	up->rollpending = 0;
+	return 0;
+}
+
+static void upload_part_end(struct Upload *up) {
+	struct Segment *seg = up->segments + up->nsegments - 1;
+
+	up->partfill = 0;
+	if(!up->rollover)
+		return;
+
+	if(seg->nparts >= S3_MAX_PART || (up->rollsize > 0 && seg->size >= up->rollsize) || (up->rolltime > 0 && time(NULL) - up->segstart >= up->rolltime))
+		up->rollpending = 1;
+}
+
+int upload_consume(struct Upload *up, const char *buffer, size_t buflen) {
+	struct Segment *seg;
+	size_t n;
+
+	SHA256_Update(&up->sha256, buffer, buflen);
+	up->bytes += buflen;
+	affinity_note(&up->readran);
+
+	while(buflen > 0) {
+		if(up->partfill == 0) {
+			/* First byte of a new part, which may also start a new segment */
+			if(up->nsegments == 0 || up->rollpending) {
+				if(segment_start(up) != 0)
+					return 1;
+			} else if(up->segments[up->nsegments-1].nparts >= S3_MAX_PART) {
+				fprintf(stderr, "Stream needs more than %d parts, use -r or -R to roll over into several objects.\n", S3_MAX_PART);
+				return 1;
+			}
+
+			up->partsstarted++;
+			up->segments[up->nsegments-1].nparts++;
+		}
+
+		seg = up->segments + up->nsegments - 1;
+		n = up->partsize - up->partfill;
+		if(n > buflen)
+			n = buflen;
+
+		if(up->rollover)
+			SHA256_Update(&up->segsha256, buffer, n);
+
+		seg->size += n;
+		up->partfill += n;
+		buffer += n;
+		buflen -= n;
+
+		if(up->partfill == up->partsize)
+			upload_part_end(up);
+	}
+
+	return 0;
+}
+
+int upload_rollover_due(struct Upload *up) {
+	return up->rollover && up->rolltime > 0 && up->nsegments > 0 && !up->rollpending && time(NULL) - up->segstart >= up->rolltime;
+}
+
+void upload_cut(struct Upload *up) {
+	/* End the current part early, the next byte goes into a new segment */
+	up->partfill = 0;
+	up->rollpending = 1;
+}
+
+void upload_end_part(struct Upload *up) {
+	/* End the current part early, e.g. before a part handed in by the caller */
+	if(up->partfill > 0)
+		upload_part_end(up);
+}
+
+void upload_publish(struct Upload *up, size_t buflen) {
+	struct Part *part = up->parts + up->published % up->nparts;
+
+	upload_publish_ref(up, part->buffer, buflen, NULL, NULL);
+}
+
+void upload_publish_ref(struct Upload *up, char *data, size_t buflen, void (*release)(void *data, void *arg), void *arg) {
+	struct Part *part;
+
+	part = up->parts + up->published % up->nparts;
+	if(up->pool != NULL && part->buffer != NULL && part->buffer != data) {
+		/* The slot's buffer is not needed for the caller's data */
+		pool_put(up->pool, &up->ps, part->buffer);
+		part->buffer = NULL;
+	}
+
+	pthread_mutex_lock(&up->lock);
+	part->partnum = ++up->published;
+	part->data = data;
+	part->release = release;
+	part->arg = arg;
+
+	while(up->pubsegment + 1 < up->nsegments && up->segments[up->pubsegment+1].firstpart <= part->partnum)
+		up->pubsegment++;
+
+	part->segment = up->pubsegment;
+	part->segpart = part->partnum - up->segments[up->pubsegment].firstpart + 1;
+	part->buflen = buflen;
+	part->refs = up->ntargets;
+	pthread_cond_broadcast(&up->cond);
+	pthread_mutex_unlock(&up->lock);
+}
+
+void upload_abort(struct Upload *up) {
+	pthread_mutex_lock(&up->lock);
+	up->aborted = 1;
+	pthread_cond_broadcast(&up->cond);
+	pthread_mutex_unlock(&up->lock);
+}
+
+int upload_finish(struct Upload *up) {
+	struct Segment *seg;
+	int i;
+	int failed = 0;
+
+	pthread_mutex_lock(&up->lock);
+	if(up->nsegments > 0) {
+		seg = up->segments + up->nsegments - 1;
+		if(up->rollover)
+			SHA256_Final(seg->hash, &up->segsha256);
+		seg->closed = 1;
+	}
+
+	up->eof = 1;
+	pthread_cond_broadcast(&up->cond);
+	pthread_mutex_unlock(&up->lock);
+
+	for(i=0; i<up->ntargets; i++) {
+		pthread_join(up->targets[i].thread, NULL);
+		if(up->targets[i].failed)
+			failed++;
+	}
+
+	SHA256_Final(up->hash, &up->sha256);
+	return failed;
+}
+
+void upload_destroy(struct Upload *up) {
+	unsigned int i;
+	int n;
+
+	if(up->parts != NULL) {
+		for(i=0; i<up->nparts; i++) {
+			if(up->pool != NULL && up->parts[i].buffer != NULL)
+				pool_put(up->pool, &up->ps, up->parts[i].buffer);
+			else
+				free(up->parts[i].buffer);
+		}
+	}
+
+	for(n=0; n<up->ntargets; n++) {
+		target_free_etags(up->targets + n);
+		free(up->targets[n].uploadId);
+		free(up->targets[n].nextUploadId);
+		free(up->targets[n].path);
+		up->targets[n].uploadId = NULL;
+		up->targets[n].nextUploadId = NULL;
+		up->targets[n].path = NULL;
+	}
+
+	free(up->parts);
+	free(up->segments);
+	up->parts = NULL;
+	up->segments = NULL;
+	pthread_mutex_destroy(&up->lock);
+	pthread_cond_destroy(&up->cond);
+}
@@ -0,0 +1,133 @@
+/* Copyright (c) 2021 J. von Rotz <jr@vrtz.ch>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <time.h>
+#include <pthread.h>
+#include <openssl/sha.h>
+#include "pool.h"
+#include "affinity.h"
+
+#define UPLOAD_DEFAULT_SLACK 1 /* Parts a slow target may lag behind before it throttles stdin */
+#define UPLOAD_SEGMENTS_SUFFIX ".segments"
+#define UPLOAD_SEGMENTS_MAGIC "s3ar-segments 1\n"
+
+struct Spool;
+
+struct Part {
+	unsigned int partnum;   /* Number of the part within the whole stream */
+	unsigned int segment;
+	unsigned int segpart;   /* Part number within its segment object */
+	char *buffer;           /* Buffer owned by this slot */
+	char *data;             /* Data to upload, either buffer or one owned by the caller */
+	size_t buflen;
+	void (*release)(void *data, void *arg); /* Called once every target has the caller's data */
+	void *arg;
+	int refs;               /* Targets which have not acknowledged this part yet */
+};
+
+struct Segment {
+	unsigned int firstpart; /* Stream part number this segment starts with */
+	unsigned int nparts;
+	unsigned long long size;
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+	short closed;           /* No more data will be added, hash is final */
+};
+
+struct Target {
+	char *name;             /* NULL for the default target */
+	char *endpoint;
+	char *bucket;
+	char *aws_key;
+	char *aws_secret;
+	char *aws_path;
+	char *path;             /* Object currently written, aws_path or a segment of it */
+	char *uploadId;
+	char *nextUploadId;     /* Already initiated upload of the next segment */
+	struct ETag *et;
+	unsigned int partnum;   /* Last stream part acknowledged by this target */
+	unsigned int segment;
+	unsigned int segparts;  /* Parts uploaded to the current segment */
+	short failed;
+	pthread_t thread;
+	struct Upload *up;
+};
+
+struct Upload {
+	struct Target *targets;
+	int ntargets;
+	int alive;              /* Targets which have not failed */
+	struct Part *parts;     /* Ring of slack+1 part buffers, shared by all targets */
+	unsigned int nparts;
+	size_t partsize;
+	unsigned int published; /* Parts handed to the targets so far */
+	short eof;
+	short aborted;          /* Input failed, do not complete anything */
+	struct Spool *spool;    /* If set, spooled parts are released once every target has them */
+	struct Pool *pool;      /* If set, part buffers and upload slots are shared with other streams */
+	struct PoolStream ps;
+	struct CpuSet *uploadcpus; /* If set, target threads are pinned to these CPUs */
+	struct CpuSet uploadran;   /* CPUs target threads were seen on */
+
+	short rollover;         /* Write aws_path.000, aws_path.001, ... instead of a single object */
+	unsigned long long rollsize;
+	unsigned int rolltime;
+	struct Segment *segments;
+	unsigned int nsegments;
+	unsigned int allocsegments;
+	unsigned int pubsegment;
+
+	/* Producer side, only touched by the thread reading the stream */
+	SHA256_CTX sha256;
+	SHA256_CTX segsha256;
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+	unsigned long long bytes;
+	struct CpuSet readran;  /* CPUs the stream was read and hashed on */
+	size_t partfill;        /* Bytes consumed into the current part */
+	unsigned int partsstarted;
+	short rollpending;      /* The next byte starts a new segment */
+	time_t segstart;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+int upload_init(struct Upload *up, struct Target *targets, int ntargets, unsigned int slack, size_t partsize, struct Spool *spool, struct Pool *pool);
+void upload_set_rollover(struct Upload *up, unsigned long long rollsize, unsigned int rolltime);
+int upload_start(struct Upload *up);
+int upload_slot(struct Upload *up);
+char *upload_buffer(struct Upload *up);
+int upload_consume(struct Upload *up, const char *buffer, size_t buflen);
+int upload_rollover_due(struct Upload *up);
+void upload_cut(struct Upload *up);
+void upload_end_part(struct Upload *up);
+void upload_publish(struct Upload *up, size_t buflen);
+void upload_publish_ref(struct Upload *up, char *data, size_t buflen, void (*release)(void *data, void *arg), void *arg);
+void upload_abort(struct Upload *up);
+int upload_finish(struct Upload *up);
+void upload_destroy(struct Upload *up);